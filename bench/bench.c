@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs petool subcommands over images from pegen and reports the median wall
+ * time of each with throughput and the peak RSS of the child. Results are
+ * written in a plain "scenario command ms rss" format so a previous run can be
+ * used as the baseline of the next one.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../src/cleanup.h"
+
+#define MAX_ARGS        24
+#define MAX_REPS        32
+#define MAX_RESULTS     128
+
+typedef struct {
+    const char *name;
+    uint32_t    size_mb;
+    uint32_t    sections;
+    uint32_t    imports;
+    uint32_t    symbols;
+    uint32_t    resources;
+    uint32_t    patches;
+    uint32_t    patch_size;
+} t_scenario;
+
+static const t_scenario scenarios[] = {
+    { "small",     1,   4,    8,   32,   64,   1000,  5 },
+    { "large",     64,  8,    64,  256,  20000, 100000, 8 },
+    { "sections",  8,   96,   8,   32,   64,   1000,  5 },
+    { "imports",   4,   4,    512, 512,  64,   1000,  5 },
+    { "patches",   16,  4,    8,   32,   64,   500000, 4 },
+    { "bigpatch",  16,  4,    8,   32,   64,   2000,  2048 },
+};
+
+typedef enum { REC_NONE, REC_SYMBOLS, REC_RESOURCES, REC_PATCHES } t_records;
+
+typedef struct {
+    const char *name;
+    const char *args[4];    // after the image, "$out" is the output file
+    t_records   records;
+    bool        fresh_copy; // command modifies the image
+} t_command;
+
+static const t_command commands[] = {
+    { "dump",     { NULL },                     REC_NONE,      false },
+    { "import",   { NULL },                     REC_SYMBOLS,   false },
+    { "re2obj",   { "$out", NULL },             REC_RESOURCES, false },
+    { "export",   { ".text", NULL },            REC_NONE,      false },
+    { "checksum", { NULL },                     REC_NONE,      false },
+    { "patch",    { ".patch", "--checksum", NULL }, REC_PATCHES, true },
+};
+
+typedef struct {
+    char        scenario[32];
+    char        command[32];
+    double      ms;
+    long        rss_kb;
+} t_result;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Runs argv with output discarded, returns the exit status or -1
+static int run(char *const *argv, double *ms, long *rss_kb)
+{
+    double start = now_ms();
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+        {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+
+    if (wait4(pid, &status, 0, &usage) != pid)
+        return -1;
+
+    *ms = now_ms() - start;
+    *rss_kb = usage.ru_maxrss;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int copy_file(const char *src, const char *dst)
+{
+    int   ret  = EXIT_SUCCESS;
+    FILE *in   = NULL;
+    FILE *out  = NULL;
+    char  buf[65536];
+    size_t n;
+
+    in = fopen(src, "rb");
+    FAIL_IF_PERROR(in == NULL, src);
+    out = fopen(dst, "wb");
+    FAIL_IF_PERROR(out == NULL, dst);
+
+    while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+        FAIL_IF_PERROR(fwrite(buf, n, 1, out) != 1, dst);
+
+cleanup:
+    if (in)  fclose(in);
+    if (out) fclose(out);
+    return ret;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int load_results(const char *path, t_result *results, uint32_t *n)
+{
+    int   ret = EXIT_SUCCESS;
+    FILE *fh  = fopen(path, "r");
+    char  line[256];
+
+    FAIL_IF_PERROR(fh == NULL, path);
+
+    while (*n < MAX_RESULTS && fgets(line, sizeof line, fh))
+    {
+        if (line[0] == '#')
+            continue;
+
+        t_result *r = &results[*n];
+        if (sscanf(line, "%31s %31s %lf %ld", r->scenario, r->command, &r->ms, &r->rss_kb) == 4)
+            (*n)++;
+    }
+
+cleanup:
+    if (fh) fclose(fh);
+    return ret;
+}
+
+static const t_result *find_result(const t_result *results, uint32_t n, const char *scenario, const char *command)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (strcmp(results[i].scenario, scenario) == 0 && strcmp(results[i].command, command) == 0)
+            return &results[i];
+    }
+
+    return NULL;
+}
+
+static uint64_t record_count(const t_scenario *s, t_records records)
+{
+    switch (records)
+    {
+        case REC_SYMBOLS:   return (uint64_t)s->imports * s->symbols;
+        case REC_RESOURCES: return s->resources;
+        case REC_PATCHES:   return s->patches;
+        default:            return 0;
+    }
+}
+
+static int generate(const char *pegen, const char *path, const t_scenario *s)
+{
+    char values[7][16];
+    uint32_t nums[7] = { s->size_mb, s->sections, s->imports, s->symbols, s->resources, s->patches, s->patch_size };
+    const char *flags[7] = { "--size", "--sections", "--imports", "--symbols", "--resources", "--patches", "--patch-size" };
+    char *argv[2 * 7 + 3];
+    int argc = 0;
+
+    argv[argc++] = (char *)pegen;
+
+    for (int i = 0; i < 7; i++)
+    {
+        snprintf(values[i], sizeof values[i], "%"PRIu32, nums[i]);
+        argv[argc++] = (char *)flags[i];
+        argv[argc++] = values[i];
+    }
+
+    argv[argc++] = (char *)path;
+    argv[argc] = NULL;
+
+    double ms;
+    long rss_kb;
+    return run(argv, &ms, &rss_kb) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+    int       ret      = EXIT_SUCCESS;
+    FILE     *ofh      = NULL;
+    t_result *baseline = NULL;
+    t_result *results  = NULL;
+    uint32_t  nbaseline = 0, nresults = 0;
+    int       reps     = 5;
+
+    FAIL_IF(argc < 5, "usage: bench <petool> <pegen> <workdir> <results> [baseline | -] [reps]\n");
+
+    const char *petool  = argv[1];
+    const char *pegen   = argv[2];
+    const char *workdir = argv[3];
+
+    if (argc > 6)
+        reps = atoi(argv[6]);
+
+    FAIL_IF(reps < 1 || reps > MAX_REPS, "Repetitions must be between 1 and %d.\n", MAX_REPS);
+
+    baseline = calloc(MAX_RESULTS, sizeof *baseline);
+    results  = calloc(MAX_RESULTS, sizeof *results);
+    FAIL_IF(!baseline || !results, "Failed to allocate memory for results\n");
+
+    // "-" runs without a baseline, a missing one is an error
+    if (argc > 5 && strcmp(argv[5], "-") != 0)
+        FAIL_IF_SILENT(load_results(argv[5], baseline, &nbaseline));
+
+    mkdir(workdir, 0777);
+
+    printf("%-9s %-9s %10s %9s %12s %10s %9s\n", "scenario", "command", "ms", "MB/s", "records/s", "RSS KB", "baseline");
+    printf("--------------------------------------------------------------------------\n");
+
+    for (size_t i = 0; i < sizeof scenarios / sizeof scenarios[0]; i++)
+    {
+        const t_scenario *s = &scenarios[i];
+        char image[1024], copy[1024], out[1024];
+
+        snprintf(image, sizeof image, "%s/%s.exe", workdir, s->name);
+        snprintf(copy, sizeof copy, "%s/%s.patched.exe", workdir, s->name);
+        snprintf(out, sizeof out, "%s/%s.o", workdir, s->name);
+
+        FAIL_IF(generate(pegen, image, s) != EXIT_SUCCESS, "Failed to generate %s\n", image);
+
+        struct stat st;
+        FAIL_IF_PERROR(stat(image, &st) != 0, image);
+        double mb = st.st_size / (1024.0 * 1024.0);
+
+        for (size_t c = 0; c < sizeof commands / sizeof commands[0]; c++)
+        {
+            const t_command *cmd = &commands[c];
+            char *cargv[MAX_ARGS];
+            int cargc = 0;
+
+            cargv[cargc++] = (char *)petool;
+            cargv[cargc++] = (char *)cmd->name;
+            cargv[cargc++] = cmd->fresh_copy ? copy : image;
+
+            for (int a = 0; cmd->args[a]; a++)
+                cargv[cargc++] = strcmp(cmd->args[a], "$out") == 0 ? out : (char *)cmd->args[a];
+
+            cargv[cargc] = NULL;
+
+            double times[MAX_REPS];
+            long rss_kb = 0;
+
+            for (int r = 0; r < reps; r++)
+            {
+                long rss;
+
+                if (cmd->fresh_copy)
+                    FAIL_IF_SILENT(copy_file(image, copy));
+
+                FAIL_IF(run(cargv, &times[r], &rss) != 0, "%s %s failed on %s\n", petool, cmd->name, image);
+
+                if (rss > rss_kb)
+                    rss_kb = rss;
+            }
+
+            qsort(times, reps, sizeof times[0], cmp_double);
+
+            t_result *res = &results[nresults++];
+            snprintf(res->scenario, sizeof res->scenario, "%s", s->name);
+            snprintf(res->command, sizeof res->command, "%s", cmd->name);
+            res->ms = times[reps / 2];
+            res->rss_kb = rss_kb;
+
+            double secs = res->ms / 1e3;
+            uint64_t records = record_count(s, cmd->records);
+            char rate[16] = "-", delta[16] = "-";
+
+            if (records)
+                snprintf(rate, sizeof rate, "%.0f", records / secs);
+
+            const t_result *base = find_result(baseline, nbaseline, res->scenario, res->command);
+
+            if (base && base->ms > 0)
+                snprintf(delta, sizeof delta, "%+.1f%%", (res->ms - base->ms) / base->ms * 100.0);
+
+            printf("%-9s %-9s %10.2f %9.1f %12s %10ld %9s\n", res->scenario, res->command, res->ms, mb / secs, rate, res->rss_kb, delta);
+        }
+
+        remove(copy);
+        remove(out);
+    }
+
+    ofh = fopen(argv[4], "w");
+    FAIL_IF_PERROR(ofh == NULL, argv[4]);
+
+    fprintf(ofh, "# scenario command median_ms peak_rss_kb\n");
+    for (uint32_t i = 0; i < nresults; i++)
+        fprintf(ofh, "%s %s %.3f %ld\n", results[i].scenario, results[i].command, results[i].ms, results[i].rss_kb);
+
+    if (argc <= 5 || strcmp(argv[5], "-") == 0)
+        printf("\nNo baseline given, times are not compared. Run 'make bench-baseline' to store one.\n");
+    else if (nbaseline == 0)
+        printf("\nNo results in baseline %s.\n", argv[5]);
+
+cleanup:
+    if (ofh)      fclose(ofh);
+    if (baseline) free(baseline);
+    if (results)  free(results);
+    return ret;
+}
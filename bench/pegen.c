@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Generates synthetic 32-bit PE images for the benchmarks: a .text section,
+ * filler data sections, an import table, a three level resource tree and a
+ * .patch section of records scattered over .text in shuffled order. The
+ * output only depends on the options so runs are comparable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../src/pe.h"
+#include "../src/cleanup.h"
+
+#define IMAGE_BASE          0x400000
+#define SECTION_ALIGNMENT   0x1000
+#define FILE_ALIGNMENT      0x200
+#define MAX_SECTIONS        96
+
+typedef struct {
+    uint32_t    size_mb;
+    uint32_t    sections;
+    uint32_t    imports;        // descriptors
+    uint32_t    symbols;        // per descriptor
+    uint32_t    resources;      // leaves
+    uint32_t    resource_size;
+    uint32_t    patches;
+    uint32_t    patch_size;
+} t_options;
+
+typedef struct {
+    char        name[IMAGE_SIZEOF_SHORT_NAME + 1];
+    uint32_t    rva;
+    uint32_t    size;
+    uint32_t    characteristics;
+    uint8_t    *data;
+} t_gensec;
+
+static uint32_t align_up(uint32_t value, uint32_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// deterministic so every run generates the same image
+static uint32_t lcg(uint32_t *state)
+{
+    *state = *state * 1664525U + 1013904223U;
+    return *state >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t value)
+{
+    memcpy(p, &value, sizeof value);
+}
+
+static int gen_text(t_gensec *sec, uint32_t size)
+{
+    sec->size = size;
+    sec->data = malloc(size);
+
+    if (!sec->data)
+        return EXIT_FAILURE;
+
+    // nops with a ret now and then
+    memset(sec->data, 0x90, size);
+
+    for (uint32_t i = 63; i < size; i += 64)
+        sec->data[i] = 0xC3;
+
+    return EXIT_SUCCESS;
+}
+
+static int gen_filler(t_gensec *sec, uint32_t size, uint32_t seed)
+{
+    sec->size = size;
+    sec->data = malloc(size);
+
+    if (!sec->data)
+        return EXIT_FAILURE;
+
+    for (uint32_t i = 0; i < size; i += 4)
+    {
+        uint32_t value = lcg(&seed);
+        memcpy(sec->data + i, &value, size - i < 4 ? size - i : 4);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Descriptors, then the lookup and address tables of each library, then the
+ * hint/name entries and library names. Every eighth symbol is imported by
+ * ordinal.
+ */
+static int gen_idata(t_gensec *sec, const t_options *opt, IMAGE_DATA_DIRECTORY *dir)
+{
+    uint32_t ndesc   = opt->imports;
+    uint32_t nthunks = opt->symbols + 1;
+    uint32_t desc    = 0;
+    uint32_t ilt     = desc + (ndesc + 1) * sizeof (IMAGE_IMPORT_DESCRIPTOR);
+    uint32_t iat     = ilt + ndesc * nthunks * 4;
+    uint32_t names   = iat + ndesc * nthunks * 4;
+
+    sec->size = names + ndesc * (opt->symbols * 16 + 16);
+    sec->data = calloc(1, sec->size);
+
+    if (!sec->data)
+        return EXIT_FAILURE;
+
+    uint32_t p = names;
+
+    for (uint32_t d = 0; d < ndesc; d++)
+    {
+        IMAGE_IMPORT_DESCRIPTOR id = { 0 };
+
+        id.OriginalFirstThunk = sec->rva + ilt + d * nthunks * 4;
+        id.FirstThunk         = sec->rva + iat + d * nthunks * 4;
+        id.Name               = sec->rva + p;
+
+        p += sprintf((char *)sec->data + p, "LIB%04"PRIu32".dll", d) + 1;
+        p = align_up(p, 2);
+
+        for (uint32_t s = 0; s < opt->symbols; s++)
+        {
+            uint32_t thunk;
+
+            if (s % 8 == 7)
+            {
+                thunk = 0x80000000 | (s + 1);
+            }
+            else
+            {
+                thunk = sec->rva + p;
+                sec->data[p] = s & 0xFF;
+                sec->data[p + 1] = s >> 8;
+                p += 2 + sprintf((char *)sec->data + p + 2, "Func%05"PRIu32, s) + 1;
+                p = align_up(p, 2);
+            }
+
+            put32(sec->data + ilt + (d * nthunks + s) * 4, thunk);
+            put32(sec->data + iat + (d * nthunks + s) * 4, thunk);
+        }
+
+        memcpy(sec->data + desc + d * sizeof id, &id, sizeof id);
+    }
+
+    sec->size = align_up(p, 4);
+    dir->VirtualAddress = sec->rva;
+    dir->Size = (ndesc + 1) * sizeof (IMAGE_IMPORT_DESCRIPTOR);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Type, name and language levels like a real resource section. The leaves are
+ * spread over up to sixteen types with one language each, and every fourth
+ * payload repeats an earlier one so duplicates show up too.
+ */
+static int gen_rsrc(t_gensec *sec, const t_options *opt, IMAGE_DATA_DIRECTORY *dir)
+{
+    uint32_t nleaves = opt->resources;
+    uint32_t ntypes  = nleaves < 16 ? nleaves : 16;
+    uint32_t dirsize = sizeof (IMAGE_RESOURCE_DIRECTORY);
+    uint32_t entsize = sizeof (IMAGE_RESOURCE_DIRECTORY_ENTRY);
+    uint32_t payload = align_up(opt->resource_size, 4);
+
+    // root, type directories, name directories with one entry each
+    uint32_t tables  = dirsize + ntypes * entsize + ntypes * dirsize + nleaves * entsize + nleaves * (dirsize + entsize);
+    uint32_t leaves  = tables;
+    uint32_t blobs   = leaves + nleaves * sizeof (IMAGE_RESOURCE_DATA_ENTRY);
+
+    sec->size = blobs + nleaves * payload;
+    sec->data = calloc(1, sec->size);
+
+    if (!sec->data)
+        return EXIT_FAILURE;
+
+    IMAGE_RESOURCE_DIRECTORY root = { 0 };
+    root.NumberOfIdEntries = ntypes;
+    memcpy(sec->data, &root, dirsize);
+
+    uint32_t p = dirsize + ntypes * entsize;
+    uint32_t leaf = 0;
+    uint32_t seed = 0x5EED;
+
+    for (uint32_t t = 0; t < ntypes; t++)
+    {
+        uint32_t nnames = nleaves / ntypes + (t < nleaves % ntypes);
+        uint32_t type_dir = p;
+
+        IMAGE_RESOURCE_DIRECTORY_ENTRY type_ent = { t + 1, 0x80000000 | type_dir };
+        memcpy(sec->data + dirsize + t * entsize, &type_ent, entsize);
+
+        IMAGE_RESOURCE_DIRECTORY names = { 0 };
+        names.NumberOfIdEntries = nnames;
+        memcpy(sec->data + type_dir, &names, dirsize);
+        p += dirsize + nnames * entsize;
+
+        for (uint32_t n = 0; n < nnames; n++, leaf++)
+        {
+            uint32_t lang_dir = p;
+
+            IMAGE_RESOURCE_DIRECTORY_ENTRY name_ent = { n + 1, 0x80000000 | lang_dir };
+            memcpy(sec->data + type_dir + dirsize + n * entsize, &name_ent, entsize);
+
+            IMAGE_RESOURCE_DIRECTORY langs = { 0 };
+            langs.NumberOfIdEntries = 1;
+            memcpy(sec->data + lang_dir, &langs, dirsize);
+
+            IMAGE_RESOURCE_DIRECTORY_ENTRY lang_ent = { 0x409, leaves + leaf * sizeof (IMAGE_RESOURCE_DATA_ENTRY) };
+            memcpy(sec->data + lang_dir + dirsize, &lang_ent, entsize);
+            p += dirsize + entsize;
+
+            IMAGE_RESOURCE_DATA_ENTRY data = { 0 };
+            data.OffsetToData = sec->rva + blobs + leaf * payload;
+            data.Size = opt->resource_size;
+            memcpy(sec->data + lang_ent.OffsetToData, &data, sizeof data);
+
+            uint8_t *blob = sec->data + blobs + leaf * payload;
+
+            if (leaf % 4 == 3)
+            {
+                memcpy(blob, blob - 3 * payload, payload);
+                continue;
+            }
+
+            for (uint32_t i = 0; i < payload; i++)
+                blob[i] = lcg(&seed);
+        }
+    }
+
+    dir->VirtualAddress = sec->rva;
+    dir->Size = sec->size;
+
+    return EXIT_SUCCESS;
+}
+
+// Records patch_size bytes apart over .text in shuffled order
+static int gen_patch(t_gensec *sec, const t_options *opt, const t_gensec *text)
+{
+    uint32_t record = 2 * sizeof (uint32_t) + opt->patch_size;
+    uint32_t *order = malloc((opt->patches + 1) * sizeof *order);
+    uint32_t seed = 0xC0DE;
+
+    sec->size = opt->patches * record;
+    sec->data = calloc(1, sec->size);
+
+    if (!sec->data || !order)
+    {
+        free(order);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < opt->patches; i++)
+        order[i] = i;
+
+    for (uint32_t i = opt->patches; i > 1; i--)
+    {
+        uint32_t j = lcg(&seed) % i;
+        uint32_t k = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = k;
+    }
+
+    for (uint32_t i = 0; i < opt->patches; i++)
+    {
+        uint8_t *p = sec->data + i * record;
+
+        put32(p, IMAGE_BASE + text->rva + order[i] * opt->patch_size * 2);
+        put32(p + 4, opt->patch_size);
+        memset(p + 8, 0xCC, opt->patch_size);
+    }
+
+    free(order);
+    return EXIT_SUCCESS;
+}
+
+static uint32_t pe_checksum(const uint8_t *image, uint32_t length, uint32_t checksum_offset)
+{
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i + 1 < length; i += 2)
+    {
+        if (i != checksum_offset && i != checksum_offset + 2)
+            sum += image[i] | image[i + 1] << 8;
+    }
+
+    if (length & 1)
+        sum += image[length - 1];
+
+    sum %= 0xFFFF;
+    return (sum ? sum : 0xFFFF) + length;
+}
+
+static bool parse_option(const char *name, const char *value, t_options *opt)
+{
+    static const struct { const char *name; size_t offset; } options[] = {
+        { "--size",          offsetof(t_options, size_mb)       },
+        { "--sections",      offsetof(t_options, sections)      },
+        { "--imports",       offsetof(t_options, imports)       },
+        { "--symbols",       offsetof(t_options, symbols)       },
+        { "--resources",     offsetof(t_options, resources)     },
+        { "--resource-size", offsetof(t_options, resource_size) },
+        { "--patches",       offsetof(t_options, patches)       },
+        { "--patch-size",    offsetof(t_options, patch_size)    },
+    };
+
+    for (size_t i = 0; i < sizeof options / sizeof options[0]; i++)
+    {
+        if (strcmp(name, options[i].name) == 0)
+        {
+            *(uint32_t *)((char *)opt + options[i].offset) = strtoul(value, NULL, 0);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    int       ret   = EXIT_SUCCESS;
+    FILE     *fh    = NULL;
+    uint8_t  *image = NULL;
+    t_gensec  secs[MAX_SECTIONS];
+    t_options opt   = { 1, 4, 8, 32, 64, 64, 1000, 5 };
+
+    memset(secs, 0, sizeof secs);
+
+    int i;
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+    {
+        FAIL_IF(!parse_option(argv[i], argv[i + 1], &opt), "Unknown option: %s\n", argv[i]);
+    }
+
+    FAIL_IF(i + 1 != argc,
+        "usage: pegen [--size <MB>] [--sections <n>] [--imports <n>] [--symbols <n>]\n"
+        "             [--resources <n>] [--resource-size <bytes>] [--patches <n>] [--patch-size <bytes>] <output>\n");
+
+    FAIL_IF(opt.sections < 4 || opt.sections > MAX_SECTIONS, "Section count must be between 4 and %d.\n", MAX_SECTIONS);
+    FAIL_IF(opt.imports < 1 || opt.resources < 1 || opt.patch_size < 1, "Imports, resources and patch size can't be zero.\n");
+
+    uint32_t nsecs   = opt.sections;
+    uint32_t nfiller = nsecs - 4;
+    uint32_t total   = opt.size_mb * 1024 * 1024;
+    uint32_t text    = align_up(opt.patches * opt.patch_size * 2 + 0x100, FILE_ALIGNMENT);
+
+    if (text < total / (nfiller + 1))
+        text = align_up(total / (nfiller + 1), FILE_ALIGNMENT);
+
+    uint32_t filler  = nfiller ? align_up((total > text ? total - text : 0) / nfiller, FILE_ALIGNMENT) : 0;
+
+    IMAGE_DATA_DIRECTORY dirs[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+    memset(dirs, 0, sizeof dirs);
+
+    uint32_t headers = align_up(sizeof (IMAGE_DOS_HEADER) + sizeof (IMAGE_NT_HEADERS) + nsecs * sizeof (IMAGE_SECTION_HEADER), FILE_ALIGNMENT);
+    uint32_t rva = align_up(headers, SECTION_ALIGNMENT);
+    uint32_t n = 0;
+
+    strcpy(secs[n].name, ".text");
+    secs[n].rva = rva;
+    secs[n].characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+    FAIL_IF(gen_text(&secs[n], text), "Failed to allocate memory for .text\n");
+    rva = align_up(rva + secs[n++].size, SECTION_ALIGNMENT);
+
+    for (uint32_t f = 0; f < nfiller; f++)
+    {
+        sprintf(secs[n].name, f ? ".data%"PRIu32 : ".data", f);
+        secs[n].rva = rva;
+        secs[n].characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE;
+        FAIL_IF(gen_filler(&secs[n], filler, f + 1), "Failed to allocate memory for %s\n", secs[n].name);
+        rva = align_up(rva + secs[n++].size, SECTION_ALIGNMENT);
+    }
+
+    strcpy(secs[n].name, ".idata");
+    secs[n].rva = rva;
+    secs[n].characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE;
+    FAIL_IF(gen_idata(&secs[n], &opt, &dirs[IMAGE_DIRECTORY_ENTRY_IMPORT]), "Failed to allocate memory for .idata\n");
+    rva = align_up(rva + secs[n++].size, SECTION_ALIGNMENT);
+
+    strcpy(secs[n].name, ".rsrc");
+    secs[n].rva = rva;
+    secs[n].characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ;
+    FAIL_IF(gen_rsrc(&secs[n], &opt, &dirs[IMAGE_DIRECTORY_ENTRY_RESOURCE]), "Failed to allocate memory for .rsrc\n");
+    rva = align_up(rva + secs[n++].size, SECTION_ALIGNMENT);
+
+    strcpy(secs[n].name, ".patch");
+    secs[n].rva = rva;
+    secs[n].characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ;
+    FAIL_IF(gen_patch(&secs[n], &opt, &secs[0]), "Failed to allocate memory for .patch\n");
+    rva = align_up(rva + secs[n++].size, SECTION_ALIGNMENT);
+
+    uint32_t length = headers;
+    for (uint32_t s = 0; s < nsecs; s++)
+        length += align_up(secs[s].size, FILE_ALIGNMENT);
+
+    image = calloc(1, length);
+    FAIL_IF(!image, "Failed to allocate memory for image\n");
+
+    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
+    dos_hdr->e_magic  = IMAGE_DOS_SIGNATURE;
+    dos_hdr->e_cblp   = 0x90;
+    dos_hdr->e_cp     = 3;
+    dos_hdr->e_cparhdr = 4;
+    dos_hdr->e_lfanew = sizeof (IMAGE_DOS_HEADER);
+
+    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+    nt_hdr->Signature                           = IMAGE_NT_SIGNATURE;
+    nt_hdr->FileHeader.Machine                  = 0x014C;
+    nt_hdr->FileHeader.NumberOfSections         = nsecs;
+    nt_hdr->FileHeader.SizeOfOptionalHeader     = sizeof (IMAGE_OPTIONAL_HEADER);
+    nt_hdr->FileHeader.Characteristics          = 0x010F;
+    nt_hdr->OptionalHeader.Magic                = 0x010B;
+    nt_hdr->OptionalHeader.AddressOfEntryPoint  = secs[0].rva;
+    nt_hdr->OptionalHeader.BaseOfCode           = secs[0].rva;
+    nt_hdr->OptionalHeader.ImageBase            = IMAGE_BASE;
+    nt_hdr->OptionalHeader.SectionAlignment     = SECTION_ALIGNMENT;
+    nt_hdr->OptionalHeader.FileAlignment        = FILE_ALIGNMENT;
+    nt_hdr->OptionalHeader.MajorOperatingSystemVersion = 4;
+    nt_hdr->OptionalHeader.MajorSubsystemVersion = 4;
+    nt_hdr->OptionalHeader.SizeOfImage          = rva;
+    nt_hdr->OptionalHeader.SizeOfHeaders        = headers;
+    nt_hdr->OptionalHeader.Subsystem            = 2;
+    nt_hdr->OptionalHeader.SizeOfStackReserve   = 0x200000;
+    nt_hdr->OptionalHeader.SizeOfStackCommit    = 0x1000;
+    nt_hdr->OptionalHeader.SizeOfHeapReserve    = 0x100000;
+    nt_hdr->OptionalHeader.SizeOfHeapCommit     = 0x1000;
+    nt_hdr->OptionalHeader.NumberOfRvaAndSizes  = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+    memcpy(nt_hdr->OptionalHeader.DataDirectory, dirs, sizeof dirs);
+
+    uint32_t offset = headers;
+
+    for (uint32_t s = 0; s < nsecs; s++)
+    {
+        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + s;
+
+        memcpy(sct_hdr->Name, secs[s].name, strlen(secs[s].name));
+        sct_hdr->Misc.VirtualSize   = secs[s].size;
+        sct_hdr->VirtualAddress     = secs[s].rva;
+        sct_hdr->SizeOfRawData      = align_up(secs[s].size, FILE_ALIGNMENT);
+        sct_hdr->PointerToRawData   = offset;
+        sct_hdr->Characteristics    = secs[s].characteristics;
+
+        if (secs[s].characteristics & IMAGE_SCN_CNT_CODE)
+            nt_hdr->OptionalHeader.SizeOfCode += sct_hdr->SizeOfRawData;
+        else
+            nt_hdr->OptionalHeader.SizeOfInitializedData += sct_hdr->SizeOfRawData;
+
+        memcpy(image + offset, secs[s].data, secs[s].size);
+        offset += sct_hdr->SizeOfRawData;
+    }
+
+    uint32_t checksum_offset = dos_hdr->e_lfanew + FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader.CheckSum);
+    nt_hdr->OptionalHeader.CheckSum = pe_checksum(image, length, checksum_offset);
+
+    fh = fopen(argv[i], "wb");
+    FAIL_IF_PERROR(fh == NULL, argv[i]);
+    FAIL_IF_PERROR(fwrite(image, length, 1, fh) != 1, argv[i]);
+
+cleanup:
+    for (uint32_t s = 0; s < MAX_SECTIONS; s++)
+        free(secs[s].data);
+
+    if (image) free(image);
+    if (fh)    fclose(fh);
+    return ret;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define MAX_PATH 260 /* including windows.h would conflict with pe.h */
+#endif
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/limits.h>
+#include <unistd.h>
+#define MAX_PATH PATH_MAX
+#define _mkdir(a) mkdir(a, 0777)
+#endif
+
+#include <errno.h>
+
+#include "cleanup.h"
+#include "common.h"
+#include "hash.h"
+#include "stats.h"
+
+int hash_file(const char *path, uint64_t *hash);
+
+/*
+ * Finished executables are kept in the cache under the hash of everything
+ * that went into them, the same files make uses to decide whether to link.
+ * A build with inputs that were built before restores the executable from
+ * there instead of linking and finalizing it again. The version of petool is
+ * part of the key so a newer one never gets an executable an older one made,
+ * and so is the salt the Makefile gives with the settings of the link.
+ * Entries are written under a name of their own and renamed into place, and
+ * made read-only, so a half written or modified one is never restored.
+ */
+static int cache_key(const char *dir, const char *salt, char **files, int nfiles, char *key, size_t size)
+{
+    int ret = EXIT_SUCCESS;
+    uint64_t hash = hash64(REV, strlen(REV), 0);
+
+    if (salt)
+        hash = hash64(salt, strlen(salt), hash);
+
+    for (int i = 0; i < nfiles; i++)
+    {
+        FAIL_IF_SILENT(hash_file(files[i], &hash));
+    }
+
+    snprintf(key, size, "%s/%016"PRIx64, dir, hash);
+
+cleanup:
+    return ret;
+}
+
+static int cache_get(const char *key, const char *image)
+{
+    int ret = EXIT_SUCCESS;
+
+    // a miss is not an error, only the exit code tells the Makefile to build
+    if (!file_exists(key))
+        return EXIT_FAILURE;
+
+    FAIL_IF_PERROR(remove(image) != 0 && errno != ENOENT, image);
+    FAIL_IF_SILENT(file_copy(key, image));
+
+    fprintf(STDOUT, "Restored %s from %s\n", image, key);
+
+cleanup:
+    return ret;
+}
+
+static int cache_put(const char *dir, const char *key, const char *image)
+{
+    int ret = EXIT_SUCCESS;
+    char tmp[MAX_PATH + 64] = { '\0' };
+
+    if (file_exists(key))
+        return EXIT_SUCCESS;
+
+    FAIL_IF_PERROR(_mkdir(dir) == -1 && errno != EEXIST, dir);
+
+#ifdef __linux__
+    snprintf(tmp, sizeof tmp, "%s.%ld.%p", key, (long)getpid(), (void *)tmp);
+#else
+    snprintf(tmp, sizeof tmp, "%s.%p", key, (void *)tmp);
+#endif
+    FAIL_IF_SILENT(file_copy(image, tmp));
+#ifdef __linux__
+    chmod(tmp, 0444);
+#endif
+    FAIL_IF_PERROR(rename(tmp, key) != 0, key);
+
+    fprintf(STDOUT, "Cached %s as %s\n", image, key);
+
+cleanup:
+    if (ret != EXIT_SUCCESS && *tmp)
+        remove(tmp);
+
+    return ret;
+}
+
+int cache(int argc, char **argv)
+{
+    int ret = EXIT_SUCCESS;
+    char key[MAX_PATH];
+
+    const char *dir = opt_value(&argc, argv, "--dir");
+    const char *salt = opt_value(&argc, argv, "--salt");
+
+    if (dir == NULL)
+        dir = getenv("PETOOL_CACHE");
+
+    FAIL_IF(argc < 4 || (strcmp(argv[1], "get") != 0 && strcmp(argv[1], "put") != 0),
+            "usage: petool cache get|put <image> <input>... [--dir <directory>] [--salt <text>]\n");
+
+    bool put = strcmp(argv[1], "put") == 0;
+
+    // no cache to use, every build is a miss and there is nothing to keep
+    if (dir == NULL || *dir == '\0')
+        return put ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    FAIL_IF_SILENT(cache_key(dir, salt, argv + 3, argc - 3, key, sizeof key));
+
+    ret = put ? cache_put(dir, key, argv[2]) : cache_get(key, argv[2]);
+
+cleanup:
+    return ret;
+}
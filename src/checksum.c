@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "pe.h"
+#include "cleanup.h"
+#include "common.h"
+#include "mapfile.h"
+#include "checksum.h"
+
+/*
+ * The PE checksum is the ones' complement sum of all 16-bit words of the file
+ * with the CheckSum field itself taken as zero, folded to 16 bits, plus the
+ * file length. A plain word sum modulo 0xFFFF is the same thing as the folded
+ * ones' complement sum, which lets the sum be adjusted for a changed range by
+ * subtracting what was there and adding what is there now.
+ */
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+static uint64_t sum_words_scalar(const uint8_t *p, size_t n)
+{
+    uint64_t lo = 0, hi = 0;
+
+    for (size_t i = 0; i + 1 < n; i += 2)
+    {
+        lo += p[i];
+        hi += p[i + 1];
+    }
+
+    return lo + (hi << 8);
+}
+
+#ifdef CHECKSUM_X86
+// low and high bytes of each word are summed separately with psadbw
+__attribute__((target("sse2")))
+static uint64_t sum_words_sse2(const uint8_t *p, size_t n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero, hi = zero;
+    uint64_t l[2], h[2];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        lo = _mm_add_epi64(lo, _mm_sad_epu8(_mm_and_si128(v, mask), zero));
+        hi = _mm_add_epi64(hi, _mm_sad_epu8(_mm_srli_epi16(v, 8), zero));
+    }
+
+    _mm_storeu_si128((__m128i *)l, lo);
+    _mm_storeu_si128((__m128i *)h, hi);
+
+    return l[0] + l[1] + ((h[0] + h[1]) << 8) + sum_words_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_words_avx2(const uint8_t *p, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero, hi = zero;
+    uint64_t l[4], h[4];
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        lo = _mm256_add_epi64(lo, _mm256_sad_epu8(_mm256_and_si256(v, mask), zero));
+        hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_srli_epi16(v, 8), zero));
+    }
+
+    _mm256_storeu_si256((__m256i *)l, lo);
+    _mm256_storeu_si256((__m256i *)h, hi);
+
+    return l[0] + l[1] + l[2] + l[3] + ((h[0] + h[1] + h[2] + h[3]) << 8) + sum_words_scalar(p + i, n - i);
+}
+#endif
+
+// Sum of little-endian words, n is even
+static uint64_t sum_words(const uint8_t *p, size_t n)
+{
+#ifdef CHECKSUM_X86
+    if (__builtin_cpu_supports("avx2"))
+        return sum_words_avx2(p, n);
+
+    if (__builtin_cpu_supports("sse2"))
+        return sum_words_sse2(p, n);
+#endif
+
+    return sum_words_scalar(p, n);
+}
+
+// Word sum over [start, end) widened to whole words, CheckSum counted as zero
+static uint64_t range_sum(const t_checksum *ck, const int8_t *image, uint32_t length, uint32_t start, uint32_t end)
+{
+    const uint8_t *p = (const uint8_t *)image;
+    uint64_t sum = 0;
+
+    start &= ~1U;
+    end = end < length ? end + (end & 1) : length;
+
+    // odd sized file, the last byte is padded to a word with zero
+    if (end & 1)
+    {
+        sum += p[--end];
+    }
+
+    sum += sum_words(p + start, end - start);
+
+    for (uint32_t i = ck->offset; i < ck->offset + sizeof(uint32_t); i++)
+    {
+        if (start <= i && i < end)
+            sum -= (uint64_t)p[i] << ((i & 1) * 8);
+    }
+
+    return sum;
+}
+
+static void set_offset(t_checksum *ck, const int8_t *image)
+{
+    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
+    ck->offset = dos_hdr->e_lfanew + FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader.CheckSum);
+}
+
+void checksum_init(t_checksum *ck, const int8_t *image, uint32_t length)
+{
+    set_offset(ck, image);
+    ck->sum = range_sum(ck, image, length, 0, length) % 0xFFFF;
+}
+
+/*
+ * Continues from the stored CheckSum if there is one, returns false if it had
+ * to rehash. Nothing tells a stale CheckSum from a right one so this is only
+ * for images whose CheckSum is known to be right, like one petool just wrote.
+ */
+bool checksum_resume(t_checksum *ck, const int8_t *image, uint32_t length)
+{
+    set_offset(ck, image);
+
+    uint32_t stored = *(uint32_t *)(image + ck->offset);
+    uint32_t folded = stored - length;
+
+    if (stored != 0 && folded > 0 && folded <= 0xFFFF)
+    {
+        ck->sum = folded % 0xFFFF;
+        return true;
+    }
+
+    checksum_init(ck, image, length);
+    return false;
+}
+
+// Call before changing size bytes at p
+void checksum_remove(t_checksum *ck, const int8_t *image, uint32_t length, const void *p, uint32_t size)
+{
+    uint32_t start = (const int8_t *)p - image;
+    uint32_t sum = range_sum(ck, image, length, start, start + size) % 0xFFFF;
+    ck->sum = (ck->sum + 0xFFFF - sum) % 0xFFFF;
+}
+
+// Call after changing size bytes at p
+void checksum_add(t_checksum *ck, const int8_t *image, uint32_t length, const void *p, uint32_t size)
+{
+    uint32_t start = (const int8_t *)p - image;
+    uint32_t sum = range_sum(ck, image, length, start, start + size) % 0xFFFF;
+    ck->sum = (ck->sum + sum) % 0xFFFF;
+}
+
+uint32_t checksum_value(const t_checksum *ck, uint32_t length)
+{
+    return (ck->sum ? ck->sum : 0xFFFF) + length;
+}
+
+int checksum(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int       ret = EXIT_SUCCESS;
+    t_mapfile map = { 0 };
+
+    FAIL_IF(argc < 2, "usage: petool checksum <image>\n");
+
+    FAIL_IF_SILENT(mapfile_open(&map, argv[1], MAPFILE_READ));
+
+    int8_t  *image  = map.image;
+    uint32_t length = map.length;
+
+    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
+    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+
+    FAIL_IF(length < 512,                            "File too small.\n");
+    FAIL_IF(dos_hdr->e_magic != IMAGE_DOS_SIGNATURE, "File DOS signature invalid.\n");
+    FAIL_IF(nt_hdr->Signature != IMAGE_NT_SIGNATURE, "File NT signature invalid.\n");
+
+    t_checksum ck;
+    checksum_init(&ck, image, length);
+
+    uint32_t stored = nt_hdr->OptionalHeader.CheckSum;
+    uint32_t computed = checksum_value(&ck, length);
+
+    fprintf(STDOUT, "CheckSum: %08"PRIX32" (computed %08"PRIX32")\n", stored, computed);
+
+    FAIL_IF(stored != computed, "CheckSum mismatch.\n");
+
+cleanup:
+    mapfile_close(&map);
+    return ret;
+}
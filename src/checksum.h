@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint32_t    offset;     // file offset of OptionalHeader.CheckSum
+    uint32_t    sum;        // 16-bit word sum modulo 0xFFFF, CheckSum excluded
+} t_checksum;
+
+void checksum_init(t_checksum *ck, const int8_t *image, uint32_t length);
+bool checksum_resume(t_checksum *ck, const int8_t *image, uint32_t length);
+void checksum_remove(t_checksum *ck, const int8_t *image, uint32_t length, const void *p, uint32_t size);
+void checksum_add(t_checksum *ck, const int8_t *image, uint32_t length, const void *p, uint32_t size);
+uint32_t checksum_value(const t_checksum *ck, uint32_t length);
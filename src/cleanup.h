@@ -1,5 +1,11 @@
 #pragma once
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+
 #define FAIL_IF_SILENT(COND)                    \
     if (COND) {                                 \
         ret = EXIT_FAILURE;                     \
@@ -8,14 +14,14 @@
 
 #define FAIL_IF(COND, ...)                      \
     if (COND) {                                 \
-        fprintf(stderr, __VA_ARGS__);           \
+        fprintf(STDERR, __VA_ARGS__);           \
         ret = EXIT_FAILURE;                     \
         goto cleanup;                           \
     }
 
-#define FAIL_IF_PERROR(COND, MSG)               \
-    if (COND) {                                 \
-        perror(MSG);                            \
-        ret = EXIT_FAILURE;                     \
-        goto cleanup;                           \
+#define FAIL_IF_PERROR(COND, MSG)                           \
+    if (COND) {                                             \
+        fprintf(STDERR, "%s: %s\n", MSG, strerror(errno));  \
+        ret = EXIT_FAILURE;                                 \
+        goto cleanup;                                       \
     }
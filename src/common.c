@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,34 +9,63 @@
 #include <inttypes.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #include "cleanup.h"
 #include "common.h"
+#include "stats.h"
 
-
-// Caller cleans up fh and image, length is optional
-int open_and_read(FILE **fh, int8_t **image, uint32_t *length,
-                  const char* executable, const char *fopen_attr)
+// Removes flag from the arguments, returns true if it was given
+bool opt_flag(int *argc, char **argv, const char *flag)
 {
-    int ret = EXIT_SUCCESS;
+    bool found = false;
 
-    *fh = fopen(executable, fopen_attr);
-    FAIL_IF_PERROR(!*fh, "Could not open executable");
-
-    FAIL_IF_PERROR(fseek(*fh, 0L, SEEK_END),
-                   "Need seekable file for executable, not stream");
-
-    uint32_t len = ftell(*fh);
-    rewind(*fh);
+    for (int i = 1; i < *argc;)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            memmove(&argv[i], &argv[i + 1], (*argc - i - 1) * sizeof *argv);
+            (*argc)--;
+            found = true;
+        }
+        else
+        {
+            i++;
+        }
+    }
 
-    *image = malloc(len);
-    FAIL_IF(!*image, "Failed to allocate memory to read executable with\n");
+    return found;
+}
 
-    FAIL_IF_PERROR(fread(*image, len, 1, *fh) != 1, "Error reading executable");
+// Removes flag and the value after it from the arguments, NULL if not given
+const char *opt_value(int *argc, char **argv, const char *flag)
+{
+    const char *value = NULL;
 
-    if (length) *length = len;
+    for (int i = 1; i + 1 < *argc;)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            value = argv[i + 1];
+            memmove(&argv[i], &argv[i + 2], (*argc - i - 2) * sizeof *argv);
+            *argc -= 2;
+        }
+        else
+        {
+            i++;
+        }
+    }
 
-cleanup:
-    return ret;
+    return value;
 }
 
 bool file_exists(const char *path)
@@ -48,9 +81,9 @@ bool file_exists(const char *path)
     return false;
 }
 
+// Points into path so it is safe to use from any thread
 const char *file_basename(const char *path)
 {
-    static char basebuf[4096];
     size_t i;
 
     if (path == NULL)
@@ -65,18 +98,27 @@ const char *file_basename(const char *path)
         }
     }
 
-    strncpy(basebuf, path + i, sizeof basebuf - 1);
-    basebuf[sizeof basebuf - 1] = '\0';
+    return path + i;
+}
 
-    return basebuf;
+#ifdef __linux__
+// Shares the extents of from with to on file systems that support it
+static bool reflink(FILE *from, FILE *to)
+{
+#ifdef FICLONE
+    return ioctl(fileno(to), FICLONE, fileno(from)) == 0;
+#else
+    (void)from;
+    (void)to;
+    return false;
+#endif
 }
+#endif
 
 int file_copy(const char* from, const char *to)
 {
     int ret = EXIT_SUCCESS;
     FILE *from_fh = NULL, *to_fh = NULL;
-    static char buf[4096];
-    size_t numread;
 
     from_fh = fopen(from, "rb");
     FAIL_IF_PERROR(!from_fh, "Could not open input file");
@@ -86,13 +128,136 @@ int file_copy(const char* from, const char *to)
     to_fh = fopen(to, "wb");
     FAIL_IF_PERROR(!to_fh, "Could not open output file");
 
-    while ((numread = fread(buf, 1, sizeof buf, from_fh)) > 0)
-    {
-        FAIL_IF_PERROR(fwrite(buf, 1, numread, to_fh) != numread, "Output file truncated");
-    }
+#ifdef __linux__
+    if (reflink(from_fh, to_fh))
+        goto cleanup;
+#endif
+
+    FAIL_IF_PERROR(fseek(from_fh, 0L, SEEK_END) != 0, "Could not read input file");
+    long length = ftell(from_fh);
+    FAIL_IF_PERROR(length < 0, "Could not read input file");
+
+    FAIL_IF_SILENT(file_send(from_fh, 0, length, to_fh));
+    STATS_COUNT(STATS_BYTES_WRITTEN, length);
 
 cleanup:
     if (from_fh) fclose(from_fh);
     if (to_fh) fclose(to_fh);
     return ret;
 }
+
+/*
+ * Makes to a file with the contents of from that takes no extra space if the
+ * system can do that: a reflink shares the data copy-on-write, a hard link
+ * shares the file itself. Both fall back to a plain copy.
+ */
+int file_link(const char *from, const char *to)
+{
+#ifdef __linux__
+    FILE *from_fh = fopen(from, "rb");
+    FILE *to_fh   = from_fh && !file_exists(to) ? fopen(to, "wb") : NULL;
+    bool  cloned  = to_fh && reflink(from_fh, to_fh);
+
+    if (from_fh) fclose(from_fh);
+    if (to_fh)   fclose(to_fh);
+
+    if (cloned)
+        return EXIT_SUCCESS;
+
+    if (to_fh)
+        remove(to);
+#endif
+
+#ifndef _WIN32
+    if (link(from, to) == 0)
+        return EXIT_SUCCESS;
+#endif
+
+    return file_copy(from, to);
+}
+
+#define SEND_BUFFER (1024 * 1024)
+
+#ifdef __linux__
+// Lets the kernel move the data, returns how much it did before giving up
+static uint32_t kernel_send(int in, uint32_t offset, uint32_t length, int out)
+{
+    off_t pos = offset;
+    uint32_t done = 0;
+    bool ranges = true;
+
+    while (done < length)
+    {
+        ssize_t n = -1;
+
+        // file to file, shares extents on filesystems that can
+        if (ranges)
+        {
+            n = copy_file_range(in, &pos, out, NULL, length - done, 0);
+
+            if (n <= 0)
+            {
+                ranges = false;
+                continue;
+            }
+        }
+        else
+        {
+            n = sendfile(out, in, &pos, length - done);
+
+            if (n <= 0)
+                break;
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+#endif
+
+/*
+ * Copies length bytes at offset of from to the current position of to without
+ * bringing them through user space when the system allows it, otherwise
+ * through a buffer of bounded size.
+ */
+int file_send(FILE *from, uint32_t offset, uint32_t length, FILE *to)
+{
+    int ret = EXIT_SUCCESS;
+    char *buf = NULL;
+    uint32_t done = 0;
+
+    FAIL_IF_PERROR(fflush(to) != 0, "Error writing output");
+
+#ifdef __linux__
+    done = kernel_send(fileno(from), offset, length, fileno(to));
+#endif
+
+    if (done < length)
+    {
+        size_t size = length - done < SEND_BUFFER ? length - done : SEND_BUFFER;
+
+        buf = malloc(size);
+        FAIL_IF(!buf, "Failed to allocate memory for copying\n");
+        STATS_ALLOC(size);
+
+        FAIL_IF_PERROR(fseek(from, offset + done, SEEK_SET) != 0, "Error reading input");
+
+        while (done < length)
+        {
+            size_t n = length - done < size ? length - done : size;
+
+            FAIL_IF_PERROR(fread(buf, n, 1, from) != 1, "Error reading input");
+            FAIL_IF_PERROR(fwrite(buf, n, 1, to) != 1, "Error writing output");
+            done += n;
+        }
+
+        FAIL_IF_PERROR(fflush(to) != 0, "Error writing output");
+    }
+
+    STATS_COUNT(STATS_BYTES_READ, length);
+
+cleanup:
+    if (buf) free(buf);
+    return ret;
+}
@@ -1,7 +1,20 @@
+#pragma once
+
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-int open_and_read(FILE**, int8_t**, uint32_t *, const char*, const char*);
+// Where commands print, batch points these at a buffer for each job
+extern __thread FILE *cmd_stdout;
+extern __thread FILE *cmd_stderr;
+
+#define STDOUT (cmd_stdout ? cmd_stdout : stdout)
+#define STDERR (cmd_stderr ? cmd_stderr : stderr)
+
+bool opt_flag(int *argc, char **argv, const char *flag);
+const char *opt_value(int *argc, char **argv, const char *flag);
 bool file_exists(const char *path);
 const char *file_basename(const char *path);
 int file_copy(const char* from, const char *to);
+int file_link(const char *from, const char *to);
+int file_send(FILE *from, uint32_t offset, uint32_t length, FILE *to);
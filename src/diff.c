@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pe.h"
+#include "cleanup.h"
+#include "common.h"
+#include "outbuf.h"
+#include "pe_image.h"
+#include "stats.h"
+
+/*
+ * Turns what differs between two images into patch records: every section of
+ * the second is compared with the bytes of the first at the same address, for
+ * as far as both have file data there. Differences closer than the header of
+ * a record are joined into one record, which is never larger than two.
+ */
+
+#define DIFF_GAP    8       // address and length of a record
+#define DIFF_LINE   32      // bytes per memcpy in assembly
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define DIFF_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    uint32_t                address;
+    uint32_t                length;
+    const uint8_t          *data;       // in the second image
+    PIMAGE_SECTION_HEADER   section;
+} t_run;
+
+typedef struct {
+    t_run      *runs;
+    uint32_t    nruns;
+    uint32_t    size;
+    uint32_t    bytes;          // that differ, gaps joined into runs included
+    uint32_t    outside;        // of the second with nothing in the first to patch
+} t_diff;
+
+// First i from start where a[i] == b[i] is same, n if there is none
+static size_t scan_scalar(const uint8_t *a, const uint8_t *b, size_t start, size_t n, bool same)
+{
+    for (size_t i = start; i < n; i++)
+    {
+        if ((a[i] == b[i]) == same)
+            return i;
+    }
+
+    return n;
+}
+
+#ifdef DIFF_X86
+__attribute__((target("sse2")))
+static size_t scan_sse2(const uint8_t *a, const uint8_t *b, size_t start, size_t n, bool same)
+{
+    size_t i = start;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        uint32_t mask = _mm_movemask_epi8(eq);
+
+        if (!same)
+            mask = ~mask & 0xFFFF;
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return scan_scalar(a, b, i, n, same);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint8_t *a, const uint8_t *b, size_t start, size_t n, bool same)
+{
+    size_t i = start;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        uint32_t mask = _mm256_movemask_epi8(eq);
+
+        if (!same)
+            mask = ~mask;
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return scan_scalar(a, b, i, n, same);
+}
+#endif
+
+static size_t scan(const uint8_t *a, const uint8_t *b, size_t start, size_t n, bool same)
+{
+#ifdef DIFF_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2(a, b, start, n, same);
+
+    if (__builtin_cpu_supports("sse2"))
+        return scan_sse2(a, b, start, n, same);
+#endif
+
+    return scan_scalar(a, b, start, n, same);
+}
+
+static int add_run(t_diff *diff, uint32_t address, uint32_t length, const uint8_t *data, PIMAGE_SECTION_HEADER section)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (diff->nruns == diff->size)
+    {
+        uint32_t size = diff->size ? diff->size * 2 : 256;
+        t_run *runs = realloc(diff->runs, size * sizeof *runs);
+        FAIL_IF(runs == NULL, "Failed to allocate memory for differences\n");
+        STATS_ALLOC(size * sizeof *runs);
+
+        diff->runs = runs;
+        diff->size = size;
+    }
+
+    diff->runs[diff->nruns++] = (t_run){ address, length, data, section };
+    diff->bytes += length;
+
+cleanup:
+    return ret;
+}
+
+// Raw data of a section without the padding up to the file alignment
+static uint32_t data_length(const PIMAGE_SECTION_HEADER sct)
+{
+    if (sct->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(sct->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA))
+        return 0;
+
+    if (sct->Misc.VirtualSize && sct->Misc.VirtualSize < sct->SizeOfRawData)
+        return sct->Misc.VirtualSize;
+
+    return sct->SizeOfRawData;
+}
+
+static int diff_section(t_diff *diff, t_pe_image *a, const t_pe_image *b, PIMAGE_SECTION_HEADER sct)
+{
+    int ret = EXIT_SUCCESS;
+    uint32_t length = data_length(sct);
+    uint32_t address = a->nt_hdr->OptionalHeader.ImageBase + sct->VirtualAddress;
+
+    if (length == 0)
+        return EXIT_SUCCESS;
+
+    FAIL_IF((uint64_t)sct->PointerToRawData + length > b->length, "%.8s is outside the second image.\n", (char *)sct->Name);
+
+    const uint8_t *new = (const uint8_t *)b->image + sct->PointerToRawData;
+    const t_secrange *range = secindex_find(&a->index, address);
+    uint32_t common = 0, skip = 0;
+
+    // past its data the first section has nothing to patch
+    if (range && address - range->start < data_length(range->hdr))
+    {
+        skip = address - range->start;
+        common = data_length(range->hdr) - skip;
+
+        if (common > length)
+            common = length;
+
+        FAIL_IF((uint64_t)range->offset + skip + common > a->length, "%.8s is outside the first image.\n", (char *)range->hdr->Name);
+    }
+
+    if (common > 0)
+    {
+        const uint8_t *old = (const uint8_t *)a->image + range->offset + skip;
+        size_t i = scan(old, new, 0, common, false);
+
+        while (i < common)
+        {
+            size_t end = scan(old, new, i, common, true);
+
+            // bytes that are the same cost less in a record than the header of another one
+            for (;;)
+            {
+                size_t next = end < common ? scan(old, new, end, common, false) : common;
+
+                if (next >= common || next - end >= DIFF_GAP)
+                    break;
+
+                end = scan(old, new, next, common, true);
+            }
+
+            FAIL_IF_SILENT(add_run(diff, address + i, end - i, new + i, sct));
+            STATS_COUNT(STATS_RECORDS, 1);
+
+            i = end < common ? scan(old, new, end, common, false) : common;
+        }
+    }
+
+    // anything but zeros there would be lost
+    for (uint32_t i = common; i < length; i++)
+    {
+        if (new[i])
+        {
+            diff->outside += length - common;
+            break;
+        }
+    }
+
+cleanup:
+    return ret;
+}
+
+static void put_report(const t_diff *diff, t_outbuf *out)
+{
+    outbuf_printf(out, " address   length  section\n");
+    outbuf_printf(out, "--------------------------\n");
+
+    for (uint32_t i = 0; i < diff->nruns; i++)
+    {
+        const t_run *run = &diff->runs[i];
+        outbuf_printf(out, "%8"PRIX32" %8"PRIX32" %8.8s\n", run->address, run->length, (char *)run->section->Name);
+    }
+
+    outbuf_printf(out, "%"PRIu32" runs, %"PRIu32" bytes\n", diff->nruns, diff->bytes);
+}
+
+static bool same_bytes(const uint8_t *p, uint32_t length)
+{
+    for (uint32_t i = 1; i < length; i++)
+    {
+        if (p[i] != p[0])
+            return false;
+    }
+
+    return true;
+}
+
+// The bytes of a .byte line as 0x%02X with commas, written straight into out
+static void put_bytes(t_outbuf *out, const uint8_t *data, uint32_t length)
+{
+    char *p = outbuf_reserve(out, length * 5);
+
+    if (p == NULL || length == 0)
+        return;
+
+    for (uint32_t i = 0; i < length; i++)
+    {
+        *p++ = '0';
+        *p++ = 'x';
+        *p++ = "0123456789ABCDEF"[data[i] >> 4];
+        *p++ = "0123456789ABCDEF"[data[i] & 0xF];
+        *p++ = ',';
+    }
+
+    out->length += length * 5 - 1;
+}
+
+static void put_asm(const t_diff *diff, const char *from, const char *to, t_outbuf *out)
+{
+    outbuf_printf(out, "/* Differences of %s from %s, generated by petool diff */\n\n", to, from);
+    outbuf_puts(out, ".include \"patch.s\"\n\n");
+
+    for (uint32_t i = 0; i < diff->nruns; i++)
+    {
+        const t_run *run = &diff->runs[i];
+
+        outbuf_printf(out, "/* %.8s */\n", (char *)run->section->Name);
+
+        if (run->length >= 4 && same_bytes(run->data, run->length))
+        {
+            outbuf_printf(out, "memset 0x%"PRIX32" 0x%02X 0x%"PRIX32"\n", run->address, run->data[0], run->address + run->length);
+            continue;
+        }
+
+        for (uint32_t j = 0; j < run->length; j += DIFF_LINE)
+        {
+            uint32_t n = run->length - j < DIFF_LINE ? run->length - j : DIFF_LINE;
+
+            outbuf_puts(out, "memcpy 0x");
+            outbuf_hex(out, run->address + j);
+            outbuf_puts(out, " \".byte ");
+
+            put_bytes(out, run->data + j, n);
+            outbuf_puts(out, "\"\n");
+        }
+    }
+}
+
+// An object with the records in a .patch section, as the patch.s macros make
+static void put_coff(const t_diff *diff, const t_pe_image *pe, t_outbuf *out)
+{
+    uint32_t length = 0;
+
+    for (uint32_t i = 0; i < diff->nruns; i++)
+    {
+        length += DIFF_GAP + diff->runs[i].length;
+    }
+
+    IMAGE_FILE_HEADER FileHeader;
+    memset(&FileHeader, 0, sizeof FileHeader);
+    FileHeader.Machine = pe->nt_hdr->FileHeader.Machine;
+    FileHeader.NumberOfSections = 1;
+    FileHeader.Characteristics = 0x0104;
+
+    IMAGE_SECTION_HEADER SectionHeader;
+    memset(&SectionHeader, 0, sizeof SectionHeader);
+    memcpy(SectionHeader.Name, ".patch", 6);
+    SectionHeader.SizeOfRawData = length;
+    SectionHeader.PointerToRawData = length ? sizeof FileHeader + sizeof SectionHeader : 0;
+    SectionHeader.Characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_ALIGN_1BYTES | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE;
+
+    outbuf_write(out, &FileHeader, sizeof FileHeader);
+    outbuf_write(out, &SectionHeader, sizeof SectionHeader);
+
+    for (uint32_t i = 0; i < diff->nruns; i++)
+    {
+        const t_run *run = &diff->runs[i];
+
+        outbuf_write(out, &run->address, sizeof run->address);
+        outbuf_write(out, &run->length, sizeof run->length);
+        outbuf_write(out, run->data, run->length);
+    }
+}
+
+int diff(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret   = EXIT_SUCCESS;
+    t_pe_image a     = { 0 };
+    t_pe_image b     = { 0 };
+    t_diff     diff  = { 0 };
+    t_outbuf   out   = { 0 };
+    FILE      *ofh   = STDOUT;
+
+    bool as_asm  = opt_flag(&argc, argv, "--asm");
+    bool as_coff = opt_flag(&argc, argv, "--coff");
+
+    FAIL_IF(argc < 3 || argc > 4 || (as_asm && as_coff), "usage: petool diff <image> <image> [ofile] [--asm | --coff]\n");
+    FAIL_IF(as_coff && argc < 4, "An object needs an output file.\n");
+    FAIL_IF(argc > 3 && file_exists(argv[3]), "%s: output file already exists.\n", argv[3]);
+
+    FAIL_IF_SILENT(pe_image_open(&a, argv[1], MAPFILE_READ, 0));
+    FAIL_IF_SILENT(pe_image_open(&b, argv[2], MAPFILE_READ, 0));
+
+    if (a.nt_hdr->OptionalHeader.ImageBase != b.nt_hdr->OptionalHeader.ImageBase)
+        fprintf(STDERR, "Warning: image bases differ, addresses are of %s.\n", argv[1]);
+
+    t_stats_phase phase = STATS_ENTER(STATS_SCAN);
+
+    for (int i = 0; i < b.nsections; i++)
+    {
+        FAIL_IF_SILENT(diff_section(&diff, &a, &b, &b.sections[i]));
+    }
+
+    STATS_LEAVE(phase);
+
+    if (diff.outside)
+        fprintf(STDERR, "Warning: %"PRIu32" bytes of %s are where %s has no data and can't be patched.\n", diff.outside, argv[2], argv[1]);
+
+    outbuf_init(&out, 65536);
+
+    if (as_coff)
+        put_coff(&diff, &b, &out);
+    else if (as_asm)
+        put_asm(&diff, file_basename(argv[1]), file_basename(argv[2]), &out);
+    else
+        put_report(&diff, &out);
+
+    if (argc > 3)
+    {
+        ofh = fopen(argv[3], as_coff ? "wb" : "w");
+        FAIL_IF_PERROR(ofh == NULL, "Could not open output file");
+    }
+
+    phase = STATS_ENTER(STATS_WRITE);
+    ret = outbuf_flush(&out, ofh);
+    STATS_LEAVE(phase);
+
+cleanup:
+    outbuf_free(&out);
+    if (diff.runs) free(diff.runs);
+    pe_image_close(&a);
+    pe_image_close(&b);
+    if (argc > 3)
+    {
+        STATS_OUTPUT(ofh);
+        if (ofh && ofh != STDOUT) fclose(ofh);
+    }
+    return ret;
+}
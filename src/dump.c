@@ -28,83 +28,64 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "outbuf.h"
+#include "stats.h"
 
-int dump(int argc, char **argv)
+int dump_image(const t_pe_image *pe)
 {
-    // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
+    int ret = EXIT_SUCCESS;
 
-    FAIL_IF(argc < 2, "usage: petool dump <image>\n");
+    PIMAGE_DOS_HEADER dos_hdr = pe->dos_hdr;
+    PIMAGE_NT_HEADERS nt_hdr = pe->nt_hdr;
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "rb"));
+    // COFF objects have no optional header to take these from
+    uint32_t image_base = pe->type == PE_IMAGE_PE ? nt_hdr->OptionalHeader.ImageBase : 0;
+    uint32_t section_alignment = pe->type == PE_IMAGE_PE ? nt_hdr->OptionalHeader.SectionAlignment : 0;
 
-    fclose(fh);
-    fh = NULL; // for cleanup
-
-    FAIL_IF(length < 512, "File too small.\n");
+    if (pe->type == PE_IMAGE_DOS)
+    {
+        uint32_t exe_start = dos_hdr->e_cparhdr * 16L;
+        uint32_t exe_end = dos_hdr->e_cp * 512L - (dos_hdr->e_cblp ? 512L - dos_hdr->e_cblp : 0);
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+        fprintf(STDOUT, "DOS Header:\n");
+        fprintf(STDOUT, " e_magic:    %04X\n", dos_hdr->e_magic);
+        fprintf(STDOUT, " e_cblp:     %04X\n", dos_hdr->e_cblp);
+        fprintf(STDOUT, " e_cp:       %04X\n", dos_hdr->e_cp);
+        fprintf(STDOUT, " e_crlc:     %04X\n", dos_hdr->e_crlc);
+        fprintf(STDOUT, " e_cparhdr:  %04X\n", dos_hdr->e_cparhdr);
+        fprintf(STDOUT, " e_minalloc: %04X\n", dos_hdr->e_minalloc);
+        fprintf(STDOUT, " e_maxalloc: %04X\n", dos_hdr->e_maxalloc);
+        fprintf(STDOUT, " e_ss:       %04X\n", dos_hdr->e_ss);
+        fprintf(STDOUT, " e_sp:       %04X\n", dos_hdr->e_sp);
+        fprintf(STDOUT, " e_csum:     %04X\n", dos_hdr->e_csum);
+        fprintf(STDOUT, " e_ip:       %04X\n", dos_hdr->e_ip);
+        fprintf(STDOUT, " e_cs:       %04X\n", dos_hdr->e_cs);
+        fprintf(STDOUT, " e_lfarlc:   %04X\n", dos_hdr->e_lfarlc);
+        fprintf(STDOUT, " e_ovno:     %04X\n", dos_hdr->e_ovno);
 
-    if (dos_hdr->e_magic == IMAGE_DOS_SIGNATURE)
-    {
-        if (nt_hdr->Signature != IMAGE_NT_SIGNATURE)
-        {
-            uint32_t exe_start = dos_hdr->e_cparhdr * 16L;
-            uint32_t exe_end = dos_hdr->e_cp * 512L - (dos_hdr->e_cblp ? 512L - dos_hdr->e_cblp : 0);
-
-            printf("DOS Header:\n");
-            printf(" e_magic:    %04X\n", dos_hdr->e_magic);
-            printf(" e_cblp:     %04X\n", dos_hdr->e_cblp);
-            printf(" e_cp:       %04X\n", dos_hdr->e_cp);
-            printf(" e_crlc:     %04X\n", dos_hdr->e_crlc);
-            printf(" e_cparhdr:  %04X\n", dos_hdr->e_cparhdr);
-            printf(" e_minalloc: %04X\n", dos_hdr->e_minalloc);
-            printf(" e_maxalloc: %04X\n", dos_hdr->e_maxalloc);
-            printf(" e_ss:       %04X\n", dos_hdr->e_ss);
-            printf(" e_sp:       %04X\n", dos_hdr->e_sp);
-            printf(" e_csum:     %04X\n", dos_hdr->e_csum);
-            printf(" e_ip:       %04X\n", dos_hdr->e_ip);
-            printf(" e_cs:       %04X\n", dos_hdr->e_cs);
-            printf(" e_lfarlc:   %04X\n", dos_hdr->e_lfarlc);
-            printf(" e_ovno:     %04X\n", dos_hdr->e_ovno);
-
-            printf("\nEXE data is from offset %04X (%d) to %04X (%d).\n", exe_start, exe_start, exe_end, exe_end);
-            goto cleanup;
-        }
-    }
-    else
-    {
-        // a hack for raw COFF object files
-        nt_hdr = (void *)(image - 4);
-        if (nt_hdr->FileHeader.Machine != 0x014C)
-        {
-            fprintf(stderr, "No valid signatures found in input file.\n");
-            goto cleanup;
-        }
+        fprintf(STDOUT, "\nEXE data is from offset %04X (%d) to %04X (%d).\n", exe_start, exe_start, exe_end, exe_end);
+        goto cleanup;
     }
 
-    printf(" section    start      end   length    vaddr    vsize  flags  align\n");
-    printf("-------------------------------------------------------------------\n");
+    fprintf(STDOUT, " section    start      end   length    vaddr    vsize  flags  align\n");
+    fprintf(STDOUT, "-------------------------------------------------------------------\n");
 
-    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    for (int i = 0; i < pe->nsections; i++)
     {
-        const PIMAGE_SECTION_HEADER cur_sct = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        const PIMAGE_SECTION_HEADER cur_sct = &pe->sections[i];
 
         uint32_t align = (cur_sct->Characteristics & IMAGE_SCN_ALIGN_MASK)
                         ? (uint32_t)(1 << (((cur_sct->Characteristics & IMAGE_SCN_ALIGN_MASK) >> 20) - 1))
-                        : nt_hdr->OptionalHeader.SectionAlignment;
+                        : section_alignment;
 
-        printf(
+        fprintf(STDOUT, 
             "%8.8s %8"PRIX32" %8"PRIX32" %8"PRIX32" %8"PRIX32" %8"PRIX32" %c%c%c%c%c%c %6"PRIX32"\n",
             cur_sct->Name,
             cur_sct->PointerToRawData,
             cur_sct->PointerToRawData + cur_sct->SizeOfRawData,
             cur_sct->SizeOfRawData,
-            cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase,
+            cur_sct->VirtualAddress + image_base,
             cur_sct->Misc.VirtualSize,
             cur_sct->Characteristics & IMAGE_SCN_MEM_READ               ? 'r' : '-',
             cur_sct->Characteristics & IMAGE_SCN_MEM_WRITE              ? 'w' : '-',
@@ -116,13 +97,282 @@ int dump(int argc, char **argv)
         );
     }
 
-    if (nt_hdr->OptionalHeader.NumberOfRvaAndSizes >= 2)
+    PIMAGE_DATA_DIRECTORY imports = pe_image_directory(pe, IMAGE_DIRECTORY_ENTRY_IMPORT);
+
+    if (imports)
     {
-        printf("Import Table: %8"PRIX32" (%"PRIu32" bytes)\n", nt_hdr->OptionalHeader.DataDirectory[1].VirtualAddress, nt_hdr->OptionalHeader.DataDirectory[1].Size);
+        fprintf(STDOUT, "Import Table: %8"PRIX32" (%"PRIu32" bytes)\n", imports->VirtualAddress, imports->Size);
     }
 
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    return ret;
+}
+
+/*
+ * Hexdumps are formatted a line at a time straight into an output buffer with
+ * a byte to digits table. With --diff only lines that differ from the same
+ * addresses of a second image are printed, that image's line under the first
+ * one with the differing bytes marked.
+ */
+
+#define HEX_LINE        16
+#define HEX_LINE_MAX    128
+#define HEX_FLUSH       (1 << 20)
+
+static const char hex_digits[] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+static char *put_hex8(char *p, uint8_t value)
+{
+    memcpy(p, &hex_digits[value * 2], 2);
+    return p + 2;
+}
+
+static char *put_hex32(char *p, uint32_t value)
+{
+    p = put_hex8(p, value >> 24);
+    p = put_hex8(p, value >> 16);
+    p = put_hex8(p, value >> 8);
+    return put_hex8(p, value);
+}
+
+// "VA RVA offset  bytes  |ascii|", prefix is a diff marker or nothing
+static void put_line(t_outbuf *out, char prefix, uint32_t va, uint32_t rva, uint32_t offset, const uint8_t *bytes, uint32_t n)
+{
+    char *p = outbuf_reserve(out, HEX_LINE_MAX);
+
+    if (p == NULL)
+        return;
+
+    char *start = p;
+
+    if (prefix)
+        *p++ = prefix;
+
+    p = put_hex32(p, va);
+    *p++ = ' ';
+    p = put_hex32(p, rva);
+    *p++ = ' ';
+    p = put_hex32(p, offset);
+    *p++ = ' ';
+
+    for (uint32_t i = 0; i < HEX_LINE; i++)
+    {
+        *p++ = ' ';
+
+        if (i < n)
+        {
+            p = put_hex8(p, bytes[i]);
+        }
+        else
+        {
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+    }
+
+    *p++ = ' ';
+    *p++ = ' ';
+    *p++ = '|';
+
+    for (uint32_t i = 0; i < n; i++)
+        *p++ = bytes[i] >= 0x20 && bytes[i] < 0x7F ? bytes[i] : '.';
+
+    *p++ = '|';
+    *p++ = '\n';
+
+    out->length += p - start;
+}
+
+static void put_marks(t_outbuf *out, const uint8_t *a, const uint8_t *b, uint32_t n)
+{
+    char *p = outbuf_reserve(out, HEX_LINE_MAX);
+
+    if (p == NULL)
+        return;
+
+    char *start = p;
+
+    memset(p, ' ', 28);
+    p += 28;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        bool differs = b == NULL || a[i] != b[i];
+
+        *p++ = ' ';
+        *p++ = differs ? '^' : ' ';
+        *p++ = differs ? '^' : ' ';
+    }
+
+    // no trailing blanks
+    while (p > start && p[-1] == ' ')
+        p--;
+
+    *p++ = '\n';
+    out->length += p - start;
+}
+
+typedef struct {
+    t_pe_image *pe;
+    t_pe_image *other;      // --diff image
+    t_outbuf    out;
+    uint32_t    lines;      // differing
+    uint32_t    bytes;      // differing
+} t_hexdump;
+
+// Bytes of the other image at va, NULL if it has none for the whole line
+static const uint8_t *other_bytes(t_pe_image *other, uint32_t va, uint32_t n, uint32_t *offset)
+{
+    const t_secrange *range = secindex_find(&other->index, va);
+
+    if (range == NULL || va + n > range->end)
+        return NULL;
+
+    *offset = range->offset + (va - range->start);
+
+    if (*offset > other->length || n > other->length - *offset)
+        return NULL;
+
+    return (const uint8_t *)other->image + *offset;
+}
+
+// Dumps the file bytes of one section from va up to end
+static int hexdump_range(t_hexdump *hd, const t_secrange *range, uint32_t va, uint32_t end)
+{
+    int ret = EXIT_SUCCESS;
+    uint32_t image_base = hd->pe->nt_hdr->OptionalHeader.ImageBase;
+    uint32_t offset = range->offset + (va - range->start);
+
+    FAIL_IF(offset > hd->pe->length, "Section at %08"PRIX32" is outside of the file.\n", range->start);
+
+    if (end - va > hd->pe->length - offset)
+        end = va + (hd->pe->length - offset);
+
+    for (; va < end; va += HEX_LINE, offset += HEX_LINE)
+    {
+        uint32_t n = end - va < HEX_LINE ? end - va : HEX_LINE;
+        const uint8_t *bytes = (const uint8_t *)hd->pe->image + offset;
+
+        if (hd->other == NULL)
+        {
+            put_line(&hd->out, 0, va, va - image_base, offset, bytes, n);
+        }
+        else
+        {
+            uint32_t other_offset = 0;
+            const uint8_t *theirs = other_bytes(hd->other, va, n, &other_offset);
+
+            if (theirs && memcmp(bytes, theirs, n) == 0)
+                continue;
+
+            for (uint32_t i = 0; i < n; i++)
+                hd->bytes += theirs == NULL || bytes[i] != theirs[i];
+
+            hd->lines++;
+
+            put_line(&hd->out, '-', va, va - image_base, offset, bytes, n);
+
+            if (theirs)
+                put_line(&hd->out, '+', va, va - image_base, other_offset, theirs, n);
+
+            put_marks(&hd->out, bytes, theirs, n);
+        }
+
+        if (hd->out.length > HEX_FLUSH)
+            FAIL_IF_SILENT(outbuf_flush(&hd->out, STDOUT));
+    }
+
+cleanup:
+    return ret;
+}
+
+static int hexdump(t_pe_image *pe, t_pe_image *other, const char *spec)
+{
+    int ret = EXIT_SUCCESS;
+    t_hexdump hd = { pe, other, { 0 }, 0, 0 };
+    uint32_t start, end;
+
+    outbuf_init(&hd.out, HEX_FLUSH + HEX_LINE_MAX * 4);
+
+    if (spec)
+    {
+        FAIL_IF_SILENT(pe_image_range(pe, spec, &start, &end));
+
+        // a range may cross sections but every byte has to come from the file
+        for (uint32_t va = start; va < end;)
+        {
+            const t_secrange *range = secindex_find(&pe->index, va);
+            FAIL_IF(range == NULL, "Address %08"PRIX32" is not backed by file data.\n", va);
+
+            uint32_t stop = end < range->end ? end : range->end;
+            FAIL_IF_SILENT(hexdump_range(&hd, range, va, stop));
+            va = stop;
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < pe->index.nranges; i++)
+        {
+            const t_secrange *range = &pe->index.ranges[i];
+            FAIL_IF_SILENT(hexdump_range(&hd, range, range->start, range->end));
+        }
+    }
+
+    if (other)
+        outbuf_printf(&hd.out, "%"PRIu32" bytes differ in %"PRIu32" lines\n", hd.bytes, hd.lines);
+
+    FAIL_IF_SILENT(outbuf_flush(&hd.out, STDOUT));
+
+cleanup:
+    outbuf_free(&hd.out);
+    return ret;
+}
+
+int dump(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret   = EXIT_SUCCESS;
+    t_pe_image pe    = { 0 };
+    t_pe_image other = { 0 };
+
+    const char *hex  = opt_value(&argc, argv, "--hex");
+    const char *diff = opt_value(&argc, argv, "--diff");
+
+    FAIL_IF(argc < 2, "usage: petool dump <image> [--hex <section|start-end|start+length>] [--diff <image>]\n");
+
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, hex || diff ? 0 : PE_ACCEPT_COFF | PE_ACCEPT_DOS));
+
+    if (diff)
+    {
+        FAIL_IF_SILENT(pe_image_open(&other, diff, MAPFILE_READ, 0));
+    }
+
+    if (hex || diff)
+    {
+        ret = hexdump(&pe, diff ? &other : NULL, hex);
+        goto cleanup;
+    }
+
+    ret = dump_image(&pe);
+
+cleanup:
+    pe_image_close(&other);
+    pe_image_close(&pe);
     return ret;
 }
@@ -26,46 +26,64 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
 
-int export(int argc, char **argv)
+/*
+ * Only the headers are looked at through the mapping, the exported bytes go
+ * from the image file to the output with file_send() so even large sections
+ * never pass through memory of our own.
+ */
+static int export_range(t_pe_image *pe, FILE *fh, const char *spec)
 {
-    // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
+    int ret = EXIT_SUCCESS;
+    uint32_t start, end;
 
-    FAIL_IF(argc < 2, "usage: petool export <image> [section]\n");
+    FAIL_IF_SILENT(pe_image_range(pe, spec, &start, &end));
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "r+b"));
+    // a range may cross sections but every byte has to come from the file
+    for (uint32_t va = start; va < end;)
+    {
+        const t_secrange *range = secindex_find(&pe->index, va);
+        FAIL_IF(range == NULL, "Address %08"PRIX32" is not backed by file data.\n", va);
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+        uint32_t stop   = end < range->end ? end : range->end;
+        uint32_t offset = range->offset + (va - range->start);
 
-    char *section = argc > 2 ? (char *)argv[2] : ".data";
-    int8_t *data = NULL;
-    int32_t data_len = 0;
+        FAIL_IF(offset > pe->length || stop - va > pe->length - offset, "'%s' extends past the end of the file.\n", spec);
+        FAIL_IF_SILENT(file_send(fh, offset, stop - va, STDOUT));
+        va = stop;
+    }
 
-    for (int32_t i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
-    {
-        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+cleanup:
+    return ret;
+}
 
-        if (strcmp(section, (char *)sct_hdr->Name) == 0)
-        {
-            data = image + sct_hdr->PointerToRawData;
-            data_len = sct_hdr->SizeOfRawData;
-            break;
-        }
+int export(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
+    FILE      *fh  = NULL;
 
-        sct_hdr++;
-    }
+    FAIL_IF(argc < 2, "usage: petool export <image> [section|start-end|start+length]...\n");
+
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, 0));
 
-    FAIL_IF(data == NULL, "No '%s' section in given PE image.\n", section);
+    fh = fopen(argv[1], "rb");
+    FAIL_IF_PERROR(fh == NULL, argv[1]);
 
-    fwrite(data, data_len, 1, stdout);
+    if (argc < 3)
+    {
+        FAIL_IF_SILENT(export_range(&pe, fh, ".data"));
+    }
+
+    for (int i = 2; i < argc; i++)
+    {
+        FAIL_IF_SILENT(export_range(&pe, fh, argv[i]));
+    }
 
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    if (fh) fclose(fh);
+    pe_image_close(&pe);
     return ret;
 }
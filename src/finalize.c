@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "pe.h"
+#include "cleanup.h"
+#include "common.h"
+#include "pe_image.h"
+#include "checksum.h"
+
+int dump_image(const t_pe_image *pe);
+int patch_section(t_pe_image *pe, const char *section, t_checksum *ck, const char *journal_path, bool strict, bool summary, bool *found);
+
+static uint32_t align_up(uint32_t value, uint32_t alignment)
+{
+    return alignment ? (value + alignment - 1) / alignment * alignment : value;
+}
+
+// Drops the COFF symbol and string tables GNU ld leaves at the end of the file
+static void strip_symbols(t_mapfile *map, PIMAGE_NT_HEADERS nt_hdr)
+{
+    uint32_t symtab = nt_hdr->FileHeader.PointerToSymbolTable;
+
+    if (symtab == 0 || symtab >= map->length)
+        return;
+
+    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    {
+        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+
+        // something else lives after the symbols, leave them be
+        if (sct_hdr->PointerToRawData + sct_hdr->SizeOfRawData > symtab)
+            return;
+    }
+
+    nt_hdr->FileHeader.PointerToSymbolTable = 0;
+    nt_hdr->FileHeader.NumberOfSymbols = 0;
+    nt_hdr->FileHeader.Characteristics |= IMAGE_FILE_LOCAL_SYMS_STRIPPED;
+    mapfile_dirty(map, &nt_hdr->FileHeader, sizeof (IMAGE_FILE_HEADER));
+
+    mapfile_truncate(map, symtab);
+}
+
+// Removes a section header and its raw data like strip -R does
+static void remove_section(t_mapfile *map, PIMAGE_NT_HEADERS nt_hdr, int index)
+{
+    PIMAGE_SECTION_HEADER sections = IMAGE_FIRST_SECTION(nt_hdr);
+    IMAGE_SECTION_HEADER removed = sections[index];
+    int nsections = nt_hdr->FileHeader.NumberOfSections;
+
+    memmove(&sections[index], &sections[index + 1], (nsections - index - 1) * sizeof *sections);
+    memset(&sections[nsections - 1], 0, sizeof *sections);
+    mapfile_dirty(map, sections, nsections * sizeof *sections);
+
+    nsections = --nt_hdr->FileHeader.NumberOfSections;
+    mapfile_dirty(map, &nt_hdr->FileHeader, sizeof (IMAGE_FILE_HEADER));
+
+    if (removed.Characteristics & IMAGE_SCN_CNT_CODE)
+        nt_hdr->OptionalHeader.SizeOfCode -= removed.SizeOfRawData;
+    else if (removed.Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA)
+        nt_hdr->OptionalHeader.SizeOfInitializedData -= removed.SizeOfRawData;
+
+    // close the gap the raw data leaves behind
+    uint32_t start = removed.PointerToRawData;
+    uint32_t end = start + removed.SizeOfRawData;
+
+    if (start > 0 && start < end && end <= map->length)
+    {
+        memmove(map->image + start, map->image + end, map->length - end);
+        mapfile_dirty(map, map->image + start, map->length - end);
+        mapfile_truncate(map, map->length - removed.SizeOfRawData);
+
+        for (int i = 0; i < nsections; i++)
+        {
+            if (sections[i].PointerToRawData >= end)
+                sections[i].PointerToRawData -= removed.SizeOfRawData;
+        }
+
+        if (nt_hdr->FileHeader.PointerToSymbolTable >= end)
+            nt_hdr->FileHeader.PointerToSymbolTable -= removed.SizeOfRawData;
+    }
+
+    uint32_t image_end = nt_hdr->OptionalHeader.SizeOfHeaders;
+
+    for (int i = 0; i < nsections; i++)
+    {
+        uint32_t size = sections[i].Misc.VirtualSize ? sections[i].Misc.VirtualSize : sections[i].SizeOfRawData;
+
+        if (sections[i].VirtualAddress + size > image_end)
+            image_end = sections[i].VirtualAddress + size;
+    }
+
+    nt_hdr->OptionalHeader.SizeOfImage = align_up(image_end, nt_hdr->OptionalHeader.SectionAlignment);
+    mapfile_dirty(map, &nt_hdr->OptionalHeader, sizeof (IMAGE_OPTIONAL_HEADER));
+}
+
+// One record per section genlds planned slack for: address, bytes used, slack
+typedef struct {
+    uint32_t address;
+    uint32_t used;
+    uint32_t size;
+} t_slack;
+
+#define SLACK_MAX 16
+
+// Copies the records from the .slack section, which goes away with the rest
+static int read_slack(const t_pe_image *pe, const PIMAGE_SECTION_HEADER slack, t_slack *records)
+{
+    uint32_t length = slack->Misc.VirtualSize < slack->SizeOfRawData ? slack->Misc.VirtualSize : slack->SizeOfRawData;
+    int count = length / 12;
+
+    if (count > SLACK_MAX)
+        count = SLACK_MAX;
+
+    if (slack->PointerToRawData + (uint64_t)count * 12 > pe->length)
+        return 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(&records[i], pe->image + slack->PointerToRawData + i * 12, 12);
+    }
+
+    return count;
+}
+
+static void dump_slack(const t_pe_image *pe, const t_slack *records, int count)
+{
+    fprintf(STDOUT, "Headroom:\n");
+
+    for (int i = 0; i < count; i++)
+    {
+        char name[9] = "?";
+
+        for (int j = 0; j < pe->nsections; j++)
+        {
+            if (pe->sections[j].VirtualAddress + pe->nt_hdr->OptionalHeader.ImageBase == records[i].address)
+            {
+                memcpy(name, pe->sections[j].Name, 8);
+                name[8] = '\0';
+            }
+        }
+
+        fprintf(STDOUT, "%8s %8"PRIX32" of %8"PRIX32" bytes used, %8"PRIX32" free\n",
+                name, records[i].used, records[i].size, records[i].used < records[i].size ? records[i].size - records[i].used : 0);
+    }
+}
+
+/*
+ * The link stamps the time into the headers, so two links of the same inputs
+ * differ. Setting those to a fixed value makes the executable the same every
+ * time, as one restored from a cache is.
+ */
+static void set_timestamp(t_pe_image *pe, uint32_t timestamp)
+{
+    PIMAGE_NT_HEADERS nt_hdr = pe->nt_hdr;
+
+    nt_hdr->FileHeader.TimeDateStamp = timestamp;
+    mapfile_dirty(&pe->map, &nt_hdr->FileHeader, sizeof (IMAGE_FILE_HEADER));
+
+    PIMAGE_DATA_DIRECTORY exports = pe_image_directory(pe, IMAGE_DIRECTORY_ENTRY_EXPORT);
+
+    if (exports && exports->VirtualAddress && exports->Size >= 8)
+    {
+        // TimeDateStamp follows Characteristics in the export directory
+        uint32_t offset = secindex_offset(&pe->index, nt_hdr->OptionalHeader.ImageBase + exports->VirtualAddress);
+
+        if (offset && (uint64_t)offset + 8 <= pe->length)
+        {
+            memcpy(pe->image + offset + 4, &timestamp, sizeof timestamp);
+            mapfile_dirty(&pe->map, pe->image + offset + 4, sizeof timestamp);
+        }
+    }
+}
+
+int finalize(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
+
+    bool summary = opt_flag(&argc, argv, "--summary");
+    bool strict  = opt_flag(&argc, argv, "--strict");
+    const char *timestamp = opt_value(&argc, argv, "--timestamp");
+
+    FAIL_IF(argc != 2 && argc != 4, "usage: petool finalize <image> [<ImportVirtualAddress> <ImportSize>] [--timestamp <time>] [--strict] [--summary]\n");
+
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_UPDATE, 0));
+
+    PIMAGE_NT_HEADERS nt_hdr = pe.nt_hdr;
+
+    if (argc == 4)
+    {
+        PIMAGE_DATA_DIRECTORY data_dir = pe_image_directory(&pe, IMAGE_DIRECTORY_ENTRY_IMPORT);
+        FAIL_IF(data_dir == NULL, "Data directory #1 is missing.\n");
+
+        data_dir->VirtualAddress = strtol(argv[2], NULL, 0);
+        data_dir->Size = strtol(argv[3], NULL, 0);
+        mapfile_dirty(&pe.map, data_dir, sizeof (IMAGE_DATA_DIRECTORY));
+    }
+
+    bool found;
+    FAIL_IF_SILENT(patch_section(&pe, ".patch", NULL, NULL, strict, summary, &found));
+
+    strip_symbols(&pe.map, nt_hdr);
+
+    PIMAGE_SECTION_HEADER patch = pe_image_section(&pe, ".patch");
+    PIMAGE_SECTION_HEADER slack = pe_image_section(&pe, ".slack");
+    t_slack records[SLACK_MAX];
+    int nrecords = slack ? read_slack(&pe, slack, records) : 0;
+
+    // the later one first so the other index stays valid
+    if (slack && patch > slack)
+    {
+        remove_section(&pe.map, nt_hdr, patch - pe.sections);
+        patch = NULL;
+    }
+
+    if (slack)
+    {
+        remove_section(&pe.map, nt_hdr, slack - pe.sections);
+    }
+
+    if (patch)
+    {
+        remove_section(&pe.map, nt_hdr, patch - pe.sections);
+    }
+
+    // the section table and length changed, bring the model up to date and rehash
+    FAIL_IF_SILENT(pe_image_parse(&pe, 0));
+
+    if (timestamp && *timestamp)
+        set_timestamp(&pe, strtoul(timestamp, NULL, 0));
+
+    t_checksum ck;
+    checksum_init(&ck, pe.image, pe.length);
+    nt_hdr->OptionalHeader.CheckSum = checksum_value(&ck, pe.length);
+    mapfile_dirty(&pe.map, &nt_hdr->OptionalHeader.CheckSum, sizeof (uint32_t));
+
+    FAIL_IF_SILENT(mapfile_sync(&pe.map));
+
+    ret = dump_image(&pe);
+
+    if (slack)
+        dump_slack(&pe, records, nrecords);
+
+cleanup:
+    pe_image_close(&pe);
+    return ret;
+}
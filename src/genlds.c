@@ -28,72 +28,172 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "stats.h"
 
-int genlds(int argc, char **argv)
+uint32_t import_size(t_pe_image *pe);
+
+// The object pe2obj --section makes of a section in split projects
+void genlds_object(const char *section, char *buf, size_t size)
 {
-    // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    FILE   *ofh   = stdout;
-    int8_t *image = NULL;
+    size_t n = snprintf(buf, size, "sect_");
 
-    FAIL_IF(argc < 2, "usage: petool genlds <image> [ofile]\n");
+    for (const char *p = section + (*section == '.'); *p && n + sizeof ".o" < size; p++)
+        buf[n++] = isalnum((unsigned char)*p) ? *p : '_';
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "rb"));
+    snprintf(buf + n, size - n, ".o");
+}
 
-    if (argc > 2)
+// Sections for new code and data, in the order they follow the original ones
+static const struct {
+    const char *key;        // as given to --slack
+    const char *section;
+    const char *inputs;
+} new_sections[] = {
+    { "idata",  ".idata",   "*(.idata)" },
+    { "text",   ".p_text",  "*(.text)" },
+    { "rdata",  ".p_rdata", "*(.rdata)" },
+    { "data",   ".p_data",  "*(.data)" },
+    { "bss",    ".p_bss",   "*(.bss) *(COMMON)" },
+    { "rsrc",   ".rsrc",    "*(.rsrc) *(.rsrc$*)" },
+};
+
+#define NEW_SECTIONS (sizeof new_sections / sizeof new_sections[0])
+
+/*
+ * Parses "<size>[,<key>=<size>]..." where a size without a key is for every
+ * section not named. Sizes take a K or M suffix and are room on top of the
+ * known size of what the section starts with, then rounded up to the section
+ * alignment. Sections before first are not placed and need none.
+ */
+static int parse_slack(const char *spec, size_t first, uint32_t alignment, const uint32_t *known, uint32_t *slack)
+{
+    int ret = EXIT_SUCCESS;
+    uint64_t fallback = 0;
+    uint64_t sizes[NEW_SECTIONS] = { 0 };
+
+    for (const char *p = spec; *p;)
     {
-        FAIL_IF(file_exists(argv[2]), "%s: output file already exists.\n", argv[2]);
-        ofh = fopen(argv[2], "w");
-        FAIL_IF_PERROR(ofh == NULL, "%s");
-    }
+        size_t len = strcspn(p, ",");
+        const char *eq = memchr(p, '=', len);
+        const char *value = eq ? eq + 1 : p;
+        uint64_t *size = &fallback;
+
+        if (eq)
+        {
+            size = NULL;
 
-    fclose(fh);
-    fh = NULL; // for cleanup
+            for (size_t i = 0; i < NEW_SECTIONS; i++)
+            {
+                if (strlen(new_sections[i].key) == (size_t)(eq - p) && strncmp(new_sections[i].key, p, eq - p) == 0)
+                    size = &sizes[i];
+            }
+
+            FAIL_IF(size == NULL, "Unknown section '%.*s' in slack, use idata, text, rdata, data, bss or rsrc.\n", (int)(eq - p), p);
+        }
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+        char *end;
+        *size = strtoul(value, &end, 0);
 
-    FAIL_IF(length < 512,                            "File too small.\n");
+        if (*end == 'k' || *end == 'K')
+            *size *= 1024, end++;
+        else if (*end == 'm' || *end == 'M')
+            *size *= 1024 * 1024, end++;
 
-    if (nt_hdr->Signature != IMAGE_NT_SIGNATURE)
+        FAIL_IF(end != p + len || end == value || *size == 0, "Invalid slack '%.*s'.\n", (int)len, p);
+
+        p += len + (p[len] == ',');
+    }
+
+    for (size_t i = first; i < NEW_SECTIONS; i++)
     {
-        nt_hdr = (void *)(image - 4);
-        FAIL_IF(nt_hdr->FileHeader.Machine != 0x014C, "No valid signatures found.\n");
+        uint64_t size = sizes[i] ? sizes[i] : fallback;
+
+        FAIL_IF(size == 0, "No slack given for %s.\n", new_sections[i].section);
+
+        size += known[i];
+        size = (size + alignment - 1) / alignment * alignment;
+        FAIL_IF(size > 0x40000000, "Slack for %s too large.\n", new_sections[i].section);
+
+        slack[i] = size;
     }
 
-    fprintf(ofh, "/* GNU ld linker script for %s */\n", file_basename(argv[1]));
+cleanup:
+    return ret;
+}
+
+/*
+ * Sections come from the image itself, or with split from an object of their
+ * own that only has to be made again when that section changes.
+ *
+ * New sections follow the original ones at the next aligned address, each
+ * moving everything after it as it grows. With slack they get fixed addresses
+ * instead and are padded to the size planned for them, so growing within that
+ * changes nothing outside the section. Sections with data end in a byte of
+ * their own so they have raw data of that size even when empty, keeping the
+ * file offsets as fixed as the addresses. A .slack section records how much
+ * of each is used for finalize to report and strip.
+ */
+int genlds_image(t_pe_image *pe, const char *name, bool split, const char *slack_spec, FILE *ofh)
+{
+    PIMAGE_NT_HEADERS nt_hdr = pe->nt_hdr;
+    uint32_t alignment = nt_hdr->OptionalHeader.SectionAlignment ? nt_hdr->OptionalHeader.SectionAlignment : 0x1000;
+    uint32_t slack[NEW_SECTIONS];
+    uint32_t known[NEW_SECTIONS] = { 0 };
+
+    // uninitialized sections are not linked from the image, a new one is made
+    const PIMAGE_SECTION_HEADER idata = pe_image_section(pe, ".idata");
+    bool idata_exists = idata && !(idata->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(idata->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA));
+
+    // rebuilt imports and resources are as large as the original ones to begin with
+    const PIMAGE_DATA_DIRECTORY resources = pe_image_directory(pe, IMAGE_DIRECTORY_ENTRY_RESOURCE);
+    known[0] = idata_exists ? 0 : import_size(pe);
+    known[NEW_SECTIONS - 1] = resources ? resources->Size : 0;
+
+    if (slack_spec && parse_slack(slack_spec, idata_exists, alignment, known, slack) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    fprintf(ofh, "/* GNU ld linker script for %s */\n", name);
     fprintf(ofh, "start = 0x%"PRIX32";\n", nt_hdr->OptionalHeader.ImageBase + nt_hdr->OptionalHeader.AddressOfEntryPoint);
     fprintf(ofh, "ENTRY(start);\n");
     fprintf(ofh, "SECTIONS\n");
     fprintf(ofh, "{\n");
 
-    bool idata_exists = false;
     uint16_t filln = 0;
 
     char align[64];
     sprintf(align, "ALIGN(0x%-4"PRIX32")", nt_hdr->OptionalHeader.SectionAlignment);
 
-    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    for (int i = 0; i < pe->nsections; i++)
     {
-        const PIMAGE_SECTION_HEADER cur_sct = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        const PIMAGE_SECTION_HEADER cur_sct = &pe->sections[i];
         char buf[9];
         memset(buf, 0, sizeof buf);
         memcpy(buf, cur_sct->Name, 8);
 
+        char object[32];
+        const char *input = name;
+
+        if (split)
+        {
+            genlds_object(buf, object, sizeof object);
+            input = object;
+        }
+
         if (cur_sct->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(cur_sct->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA)) {
-            fprintf(ofh, "    /DISCARD/                  : { %s(%s) }\n", file_basename(argv[1]), buf);
+            if (!split)
+                fprintf(ofh, "    /DISCARD/                  : { %s(%s) }\n", name, buf);
             fprintf(ofh, "    %-15s   0x%-6"PRIX32" : { . = . + 0x%"PRIX32"; }\n", buf, cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase, cur_sct->Misc.VirtualSize ? cur_sct->Misc.VirtualSize : cur_sct->SizeOfRawData);
             continue;
         }
 
         /* resource section is not directly recompilable even if it doesn't move, use re2obj command instead */
         if (strcmp(buf, ".rsrc") == 0) {
-            fprintf(ofh, "    /DISCARD/                  : { %s(%s) }\n", file_basename(argv[1]), buf);
+            if (!split)
+                fprintf(ofh, "    /DISCARD/                  : { %s(%s) }\n", name, buf);
 
 
-            if (i < nt_hdr->FileHeader.NumberOfSections - 1) {
+            if (i < pe->nsections - 1) {
                 sprintf(buf, "FILL%d", filln++);
                 fprintf(ofh, "    %-15s   0x%-6"PRIX32" : { . = . + 0x%"PRIX32"; }\n", buf, cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase, cur_sct->Misc.VirtualSize ? cur_sct->Misc.VirtualSize : cur_sct->SizeOfRawData);
             }
@@ -101,40 +201,112 @@ int genlds(int argc, char **argv)
             continue;
         }
 
-        if (strcmp(buf, ".idata") == 0) {
-            idata_exists = true;
-        }
-
         if (cur_sct->Misc.VirtualSize > cur_sct->SizeOfRawData) {
-            fprintf(ofh, "    %-15s   0x%-6"PRIX32" : { %s(%s) . = ALIGN(0x%"PRIX32"); }\n", buf, cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase, file_basename(argv[1]), buf, nt_hdr->OptionalHeader.SectionAlignment);
+            fprintf(ofh, "    %-15s   0x%-6"PRIX32" : { %s(%s) . = ALIGN(0x%"PRIX32"); }\n", buf, cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase, input, buf, nt_hdr->OptionalHeader.SectionAlignment);
             fprintf(ofh, "    .bss      %16s : { . = . + 0x%"PRIX32"; }\n", align, cur_sct->Misc.VirtualSize - cur_sct->SizeOfRawData);
             continue;
         }
 
-        fprintf(ofh, "    %-15s   0x%-6"PRIX32" : { %s(%s) }\n", buf, cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase, file_basename(argv[1]), buf);
+        fprintf(ofh, "    %-15s   0x%-6"PRIX32" : { %s(%s) }\n", buf, cur_sct->VirtualAddress + nt_hdr->OptionalHeader.ImageBase, input, buf);
     }
 
     fprintf(ofh, "\n");
 
-    if (!idata_exists) {
-        fprintf(ofh, "    .idata    %16s : { *(.idata) }\n\n", align);
+    // first address after the image
+    uint64_t next = 0;
+
+    for (int i = 0; i < pe->nsections; i++)
+    {
+        const PIMAGE_SECTION_HEADER cur_sct = &pe->sections[i];
+        uint32_t size = cur_sct->Misc.VirtualSize > cur_sct->SizeOfRawData ? cur_sct->Misc.VirtualSize : cur_sct->SizeOfRawData;
+
+        if (cur_sct->VirtualAddress + (uint64_t)size > next)
+            next = cur_sct->VirtualAddress + (uint64_t)size;
+    }
+
+    next = (next + alignment - 1) / alignment * alignment + nt_hdr->OptionalHeader.ImageBase;
+
+    for (size_t i = 0; i < NEW_SECTIONS; i++)
+    {
+        char at[32];
+
+        if (i == 0 && idata_exists)
+            continue;
+
+        if (i == 1)
+            fprintf(ofh, "    /DISCARD/                  : { *(.drectve) *(.rdata$zzz) }\n");
+
+        if (!slack_spec)
+        {
+            fprintf(ofh, "    %-9s %16s : { %s }\n", new_sections[i].section, align, new_sections[i].inputs);
+        }
+        else
+        {
+            bool bss = strcmp(new_sections[i].key, "bss") == 0;
+            uint32_t room = bss ? slack[i] : slack[i] - 1;
+
+            snprintf(at, sizeof at, "0x%-6"PRIX64, next);
+            fprintf(ofh, "    %-9s %16s : { %s __slack_%s = .; . = MAX(., 0x%"PRIX32");%s }\n",
+                    new_sections[i].section, at, new_sections[i].inputs, new_sections[i].key, room, bss ? "" : " BYTE(0)");
+            fprintf(ofh, "    ASSERT(__slack_%s - ADDR(%s) <= 0x%"PRIX32", \"%s has outgrown its slack of 0x%"PRIX32" bytes, raise it with --slack\")\n",
+                    new_sections[i].key, new_sections[i].section, room, new_sections[i].section, slack[i]);
+            next += slack[i];
+        }
+
+        if (i == 0 || i == NEW_SECTIONS - 1)
+            fprintf(ofh, "\n");
     }
 
-    fprintf(ofh, "    /DISCARD/                  : { *(.drectve) *(.rdata$zzz) }\n");
-    fprintf(ofh, "    .p_text   %16s : { *(.text) }\n", align);
-    fprintf(ofh, "    .p_rdata  %16s : { *(.rdata) }\n", align);
-    fprintf(ofh, "    .p_data   %16s : { *(.data) }\n", align);
-    fprintf(ofh, "    .p_bss    %16s : { *(.bss) *(COMMON) }\n", align);
-    fprintf(ofh, "    .rsrc     %16s : { *(.rsrc) }\n\n", align);
     fprintf(ofh, "    .patch    %16s : { *(.patch) }\n", align);
 
+    if (slack_spec)
+    {
+        fprintf(ofh, "    .slack    %16s : {", align);
+
+        for (size_t i = idata_exists; i < NEW_SECTIONS; i++)
+        {
+            uint32_t room = strcmp(new_sections[i].key, "bss") == 0 ? slack[i] : slack[i] - 1;
+
+            fprintf(ofh, " LONG(ADDR(%s)) LONG(__slack_%s - ADDR(%s)) LONG(0x%"PRIX32")",
+                    new_sections[i].section, new_sections[i].key, new_sections[i].section, room);
+        }
+
+        fprintf(ofh, " }\n");
+    }
+
     fprintf(ofh, "}\n");
 
+    return EXIT_SUCCESS;
+}
+
+int genlds(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret = EXIT_SUCCESS;
+    FILE      *ofh = STDOUT;
+    t_pe_image pe  = { 0 };
+
+    bool split = opt_flag(&argc, argv, "--split");
+    const char *slack = opt_value(&argc, argv, "--slack");
+
+    FAIL_IF(argc < 2, "usage: petool genlds <image> [ofile] [--split] [--slack <size>[,<section>=<size>]...]\n");
+
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, PE_ACCEPT_COFF));
+
+    if (argc > 2)
+    {
+        FAIL_IF(file_exists(argv[2]), "%s: output file already exists.\n", argv[2]);
+        ofh = fopen(argv[2], "w");
+        FAIL_IF_PERROR(ofh == NULL, "%s");
+    }
+
+    ret = genlds_image(&pe, file_basename(argv[1]), split, slack, ofh);
+
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    pe_image_close(&pe);
     if (argc > 2)
     {
+        STATS_OUTPUT(ofh);
         if (ofh)   fclose(ofh);
     }
     return ret;
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
@@ -23,38 +24,59 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "stats.h"
 
-int genmak(int argc, char **argv)
+int re2obj_types(const t_pe_image *pe, FILE *ofh);
+void genlds_object(const char *section, char *buf, size_t size);
+
+// Sections genlds takes from the image, each name once
+static bool linked_section(const t_pe_image *pe, int i)
 {
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
-    FILE   *ofh   = stdout;
-    char   base[256] = { '\0' };
+    const PIMAGE_SECTION_HEADER cur_sct = &pe->sections[i];
 
-    FAIL_IF(argc < 2, "usage: petool genmak <image> [ofile]\n");
+    if (cur_sct->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(cur_sct->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA))
+        return false;
 
-    if (argc > 2)
+    if (strncmp((char *)cur_sct->Name, ".rsrc", IMAGE_SIZEOF_SHORT_NAME) == 0)
+        return false;
+
+    for (int j = 0; j < i; j++)
     {
-        FAIL_IF(file_exists(argv[2]), "%s: output file already exists.\n", argv[2]);
-        ofh = fopen(argv[2], "w");
-        FAIL_IF_PERROR(ofh == NULL, "%s");
+        if (strncmp((char *)pe->sections[j].Name, (char *)cur_sct->Name, IMAGE_SIZEOF_SHORT_NAME) == 0)
+            return false;
     }
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "rb"));
+    return true;
+}
 
-    fclose(fh);
-    fh = NULL; // for cleanup
+// Writes the section name quoted for the shell with $ escaped for make
+static void put_section(const char *name, FILE *ofh)
+{
+    fprintf(ofh, "'");
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+    for (const char *c = name; *c; c++)
+        fprintf(ofh, *c == '$' ? "$$" : "%c", *c);
 
-    FAIL_IF(length < 512,                            "File too small.\n");
-    FAIL_IF(dos_hdr->e_magic != IMAGE_DOS_SIGNATURE, "File DOS signature invalid.\n");
-    FAIL_IF(nt_hdr->Signature != IMAGE_NT_SIGNATURE, "File NT signature invalid.\n");
+    fprintf(ofh, "'");
+}
 
-    strcpy(base, file_basename(argv[1]));
+/*
+ * Steps depend on stamps made by hashstamp instead of on their inputs. A stamp
+ * is remade every time but only written when the hash of what it covers
+ * changes, so touching or checking out the original does not rebuild anything
+ * that comes out the same, and an object made again with the same contents
+ * does not relink.
+ */
+int genmak_image(const t_pe_image *pe, const char *name, bool split, FILE *ofh)
+{
+    char base[256] = { '\0' };
+
+    PIMAGE_NT_HEADERS nt_hdr = pe->nt_hdr;
+    PIMAGE_DATA_DIRECTORY imports = pe_image_directory(pe, IMAGE_DIRECTORY_ENTRY_IMPORT);
+    PIMAGE_DATA_DIRECTORY resources = pe_image_directory(pe, IMAGE_DIRECTORY_ENTRY_RESOURCE);
+
+    strncpy(base, name, sizeof base - 1);
     char *p = strrchr(base, '.');
     if (p)
     {
@@ -62,14 +84,14 @@ int genmak(int argc, char **argv)
     }
 
     fprintf(ofh, "-include config.mk\n\n");
-    fprintf(ofh, "INPUT       = %s\n", file_basename(argv[1]));
+    fprintf(ofh, "INPUT       = %s\n", name);
     fprintf(ofh, "OUTPUT      = %sp.exe\n", base);
     fprintf(ofh, "LDS         = %sp.lds\n", base);
 
     fprintf(ofh, "IMPORTS     =");
-    if (nt_hdr->OptionalHeader.DataDirectory[1].VirtualAddress)
+    if (imports && imports->VirtualAddress)
     {
-        fprintf(ofh, " 0x%"PRIX32" %d", nt_hdr->OptionalHeader.DataDirectory[1].VirtualAddress, nt_hdr->OptionalHeader.DataDirectory[1].Size);
+        fprintf(ofh, " 0x%"PRIX32" %d", imports->VirtualAddress, imports->Size);
     }
     fprintf(ofh, "\n");
 
@@ -80,43 +102,151 @@ int genmak(int argc, char **argv)
 
     fprintf(ofh, "\n\n");
 
+    // resource types go in objects of their own if the directory can be split off
+    int types = 0;
+    if (resources && resources->VirtualAddress)
+    {
+        fprintf(ofh, "RSRC        = ");
+        types = re2obj_types(pe, ofh);
+        fprintf(ofh, "\n");
+    }
+
+    if (split)
+    {
+        fprintf(ofh, "SECTS       =");
+        for (int i = 0; i < pe->nsections; i++)
+        {
+            char buf[9] = { '\0' }, object[32];
+
+            if (!linked_section(pe, i))
+                continue;
+
+            memcpy(buf, pe->sections[i].Name, 8);
+            genlds_object(buf, object, sizeof object);
+            fprintf(ofh, " %s", object);
+        }
+        fprintf(ofh, "\n");
+    }
+
+    // every source is an object of its own named after it, foo.c and foo.s can both be
+    fprintf(ofh, "SRCS       ?= $(wildcard src/*.c src/*.s src/*.asm)\n");
+    fprintf(ofh, "SRC_OBJS    = $(SRCS:%%=%%.o)\n");
     fprintf(ofh, "OBJS        = ");
-    if (nt_hdr->OptionalHeader.DataDirectory[2].VirtualAddress)
+    if (resources && resources->VirtualAddress)
     {
-        fprintf(ofh, "rsrc.o");
+        fprintf(ofh, "rsrc.o $(RSRC:%%=rsrc_%%.o) ");
     }
-    fprintf(ofh, "\n\n");
+    fprintf(ofh, "$(SRC_OBJS)\n\n");
 
     fprintf(ofh, "PETOOL     ?= petool\n");
-    fprintf(ofh, "STRIP      ?= strip\n\n");
+    fprintf(ofh, "RE2OBJFLAGS ?= --dedup\n");
+    fprintf(ofh, "NASM       ?= nasm\n");
+    fprintf(ofh, "NFLAGS     ?= -f win32\n");
+    fprintf(ofh, "CFLAGS     ?= -O2 -Wall\n");
+    fprintf(ofh, "FINALIZEFLAGS ?=\n");
+    fprintf(ofh, "CACHE_KEY   = link.stamp Makefile $(wildcard config.mk) --salt '$(LD) $(LDFLAGS) $(IMPORTS) $(FINALIZEFLAGS)'\n\n");
 
     fprintf(ofh, "all: $(OUTPUT)\n\n");
+    fprintf(ofh, "FORCE:\n\n");
+
+    // each object also writes which headers and includes it read for the next run
+    fprintf(ofh, "%%.c.o: %%.c\n");
+    fprintf(ofh, "\t$(CC) $(CFLAGS) -MMD -MP -c -o $@ $<\n\n");
+    fprintf(ofh, "%%.s.o: %%.s\n");
+    fprintf(ofh, "\t$(AS) $(ASFLAGS) --MD $(@:.o=.d) -o $@ $<\n\n");
+    fprintf(ofh, "%%.asm.o: %%.asm\n");
+    fprintf(ofh, "\t$(NASM) $(NFLAGS) -MD $(@:.o=.d) -o $@ $<\n\n");
+    fprintf(ofh, "-include $(SRC_OBJS:.o=.d)\n\n");
+
+    if (resources && resources->VirtualAddress)
+    {
+        fprintf(ofh, "rsrc.stamp: FORCE\n");
+        fprintf(ofh, "\t@$(PETOOL) hashstamp $@ $(INPUT) --section .rsrc\n\n");
+
+        fprintf(ofh, "rsrc.o: rsrc.stamp\n");
+        fprintf(ofh, "\t$(PETOOL) re2obj $(INPUT) $@%s $(RE2OBJFLAGS)\n\n", types ? " --tree" : "");
+
+        // each type is stamped with its own payloads, static rules keep make from deleting the stamps
+        if (types)
+        {
+            fprintf(ofh, "$(RSRC:%%=rsrc_%%.stamp): rsrc_%%.stamp: FORCE\n");
+            fprintf(ofh, "\t@$(PETOOL) hashstamp $@ $(INPUT) --type $*\n\n");
 
-    if (nt_hdr->OptionalHeader.DataDirectory[2].VirtualAddress)
+            fprintf(ofh, "$(RSRC:%%=rsrc_%%.o): rsrc_%%.o: rsrc_%%.stamp\n");
+            fprintf(ofh, "\t$(PETOOL) re2obj $(INPUT) $@ --type $* $(RE2OBJFLAGS)\n\n");
+        }
+    }
+
+    // the linker script names the section objects, ld finds them from there
+    for (int i = 0; split && i < pe->nsections; i++)
     {
-        fprintf(ofh, "rsrc.o: $(INPUT)\n");
-        fprintf(ofh, "\t$(PETOOL) re2obj $(INPUT) $@\n\n");
+        char buf[9] = { '\0' }, object[32];
+
+        if (!linked_section(pe, i))
+            continue;
+
+        memcpy(buf, pe->sections[i].Name, 8);
+        genlds_object(buf, object, sizeof object);
+
+        // sect_<name>.o is stamped by sect_<name>.stamp
+        int stem = (int)strlen(object) - 2;
+
+        fprintf(ofh, "%.*s.stamp: FORCE\n", stem, object);
+        fprintf(ofh, "\t@$(PETOOL) hashstamp $@ $(INPUT) --section ");
+        put_section(buf, ofh);
+        fprintf(ofh, "\n\n");
+
+        fprintf(ofh, "%s: %.*s.stamp\n", object, stem, object);
+        fprintf(ofh, "\t$(PETOOL) pe2obj $(INPUT) $@ --section ");
+        put_section(buf, ofh);
+        fprintf(ofh, "\n\n");
     }
 
-    fprintf(ofh, "$(OUTPUT): $(LDS) $(INPUT) $(OBJS)\n");
-    fprintf(ofh, "\t$(LD) $(LDFLAGS) -T $(LDS) -o $@ $(OBJS)\n");
-    fprintf(ofh, "ifneq (,$(IMPORTS))\n");
-    fprintf(ofh, "\t$(PETOOL) setdd $@ 1 $(IMPORTS) || ($(RM) $@ && exit 1)\n");
-    fprintf(ofh, "endif\n");
-    fprintf(ofh, "\t$(PETOOL) patch $@ || ($(RM) $@ && exit 1)\n");
-    fprintf(ofh, "\t$(STRIP) -R .patch $@ || ($(RM) $@ && exit 1)\n");
-    fprintf(ofh, "\t$(PETOOL) dump $@\n\n");
+    // the linker script names the original or the section objects, so they are hashed too
+    fprintf(ofh, "link.stamp: $(LDS) %s $(OBJS) FORCE\n", split ? "$(SECTS)" : "$(INPUT)");
+    fprintf(ofh, "\t@$(PETOOL) hashstamp $@ $(LDS) %s $(OBJS)\n\n", split ? "$(SECTS)" : "$(INPUT)");
+
+    // with PETOOL_CACHE set an executable linked before from the same inputs is restored from there
+    fprintf(ofh, "$(OUTPUT): link.stamp\n");
+    fprintf(ofh, "\t$(PETOOL) cache get $@ $(CACHE_KEY) || ( \\\n");
+    fprintf(ofh, "\t$(LD) $(LDFLAGS) -T $(LDS) -o $@ $(OBJS) && \\\n");
+    fprintf(ofh, "\t$(PETOOL) finalize $@ $(IMPORTS) $(FINALIZEFLAGS) && \\\n");
+    fprintf(ofh, "\t$(PETOOL) cache put $@ $(CACHE_KEY) ) || ($(RM) $@ && exit 1)\n\n");
 
     fprintf(ofh, "clean:\n");
-    fprintf(ofh, "\t$(RM) $(OUTPUT) $(OBJS)\n");
+    fprintf(ofh, "\t$(RM) $(OUTPUT) $(OBJS)%s $(SRC_OBJS:.o=.d) *.stamp\n", split ? " $(SECTS)" : "");
+
+    return EXIT_SUCCESS;
+}
+
+int genmak(int argc, char **argv)
+{
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
+    FILE      *ofh = STDOUT;
+
+    bool split = opt_flag(&argc, argv, "--split");
+
+    FAIL_IF(argc < 2, "usage: petool genmak <image> [ofile] [--split]\n");
+
+    if (argc > 2)
+    {
+        FAIL_IF(file_exists(argv[2]), "%s: output file already exists.\n", argv[2]);
+        ofh = fopen(argv[2], "w");
+        FAIL_IF_PERROR(ofh == NULL, "%s");
+    }
+
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, 0));
+
+    ret = genmak_image(&pe, file_basename(argv[1]), split, ofh);
 
 cleanup:
     if (argc > 2)
     {
+        STATS_OUTPUT(ofh);
         if (ofh)   fclose(ofh);
     }
 
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    pe_image_close(&pe);
     return ret;
 }
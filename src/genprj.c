@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
@@ -29,13 +30,19 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <linux/limits.h>
+#include <unistd.h>
 #define MAX_PATH PATH_MAX
 #define _mkdir(a) mkdir(a, 0777)
 #endif
 
+#include <errno.h>
+
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "stats.h"
+#include "hash.h"
 
 /* embed patch.s */
 extern const char patch_s[];
@@ -45,20 +52,83 @@ __asm(".data;"
       ".incbin \"patch.s\";"
       ".byte 0");
 
-int genlds(int argc, char **argv);
-int genmak(int argc, char **argv);
+int genlds_image(t_pe_image *pe, const char *name, bool split, const char *slack, FILE *ofh);
+int genmak_image(const t_pe_image *pe, const char *name, bool split, FILE *ofh);
+
+/*
+ * With a store every original goes into it once, named by the hash and size
+ * of its contents, and projects get a reflink or a hard link of that file
+ * instead of a copy of their own. Stored files are made read-only since hard
+ * links share them with every project.
+ */
+static int store_original(const t_pe_image *pe, const char *store, const char *path, const char *dst)
+{
+    int ret = EXIT_SUCCESS;
+    t_mapfile stored = { 0 };
+    char key[MAX_PATH];
+    char tmp[MAX_PATH + 64];
+
+    const char *ext = strrchr(file_basename(path), '.');
+
+    snprintf(key, sizeof key, "%s/%016"PRIx64"-%08"PRIx32"%s", store, hash64(pe->image, pe->length, 0), pe->length, ext ? ext : "");
+
+    FAIL_IF_PERROR(_mkdir(store) == -1 && errno != EEXIST, store);
+
+    if (!file_exists(key))
+    {
+        // under a name of its own first so no one links a half written file
+#ifdef __linux__
+        snprintf(tmp, sizeof tmp, "%s.%ld.%p", key, (long)getpid(), (void *)tmp);
+#else
+        snprintf(tmp, sizeof tmp, "%s.%p", key, (void *)tmp);
+#endif
+        FAIL_IF_SILENT(file_copy(path, tmp));
+        FAIL_IF_PERROR(rename(tmp, key) != 0, key);
+#ifdef __linux__
+        chmod(key, 0444);
+#endif
+    }
+
+    // the hash only finds the file, the contents have to match too
+    FAIL_IF_SILENT(mapfile_open(&stored, key, MAPFILE_READ));
+
+    if (stored.length != pe->length || memcmp(stored.image, pe->image, pe->length) != 0)
+    {
+        fprintf(STDERR, "Warning: %s differs from %s, copying instead.\n", key, path);
+        ret = file_copy(path, dst);
+        goto cleanup;
+    }
+
+    fprintf(STDOUT, "Linking %s -> %s...\n", key, dst);
+    ret = file_link(key, dst);
+
+cleanup:
+    mapfile_close(&stored);
+    return ret;
+}
 
 int genprj(int argc, char **argv)
 {
     int ret = EXIT_SUCCESS;
-    static char base[MAX_PATH];
-    static char buf[MAX_PATH];
-    static char dir[MAX_PATH];
-    char *cmd_argv[3] = { argv[0], argv[1], buf };
+    t_pe_image pe = { 0 };
+    FILE *fh = NULL;
+    char base[MAX_PATH];
+    char buf[MAX_PATH];
+    char dir[MAX_PATH];
+
+    const char *store = opt_value(&argc, argv, "--store");
+    bool split = opt_flag(&argc, argv, "--split");
+    const char *slack = opt_value(&argc, argv, "--slack");
 
-    FAIL_IF(argc < 2, "usage: petool genprj <image> [directory]\n");
+    if (store == NULL)
+        store = getenv("PETOOL_STORE");
+
+    FAIL_IF(argc < 2, "usage: petool genprj <image> [directory] [--store <directory>] [--split] [--slack <size>[,<section>=<size>]...]\n");
     FAIL_IF(!file_exists(argv[1]), "input file missing\n");
 
+    // parsed once, the linker script and the Makefile are both generated from it
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, 0));
+
     memset(base, 0, sizeof base);
     strncpy(base, file_basename(argv[1]), sizeof(base) - 1);
     char *p = strrchr(base, '.');
@@ -77,31 +147,52 @@ int genprj(int argc, char **argv)
         snprintf(dir, sizeof dir, "%sp", base);
     }
 
-    printf("Input file      : %s\n", argv[1]);
-    printf("Output directory: %s\n", dir);
+    fprintf(STDOUT, "Input file      : %s\n", argv[1]);
+    fprintf(STDOUT, "Output directory: %s\n", dir);
 
     FAIL_IF_PERROR(_mkdir(dir) == -1, "Failed to create output directory");
 
     snprintf(buf, sizeof buf, "%s/%s", dir, file_basename(argv[1]));
-    printf("Copying %s -> %s...\n", argv[1], buf);
-    FAIL_IF(file_copy(argv[1], buf) != EXIT_SUCCESS, "Failed to copy file\n");
+
+    if (store && *store)
+    {
+        FAIL_IF(store_original(&pe, store, argv[1], buf) != EXIT_SUCCESS, "Failed to link file from store\n");
+    }
+    else
+    {
+        fprintf(STDOUT, "Copying %s -> %s...\n", argv[1], buf);
+        FAIL_IF(file_copy(argv[1], buf) != EXIT_SUCCESS, "Failed to copy file\n");
+    }
+
+    // the Makefile builds whatever is put in here
+    FAIL_IF(snprintf(buf, sizeof buf, "%s/src", dir) >= (int)sizeof buf, "Output directory path too long\n");
+    FAIL_IF_PERROR(_mkdir(buf) == -1, "Failed to create source directory");
 
     snprintf(buf, sizeof buf, "%s/patch.s", dir);
-    printf("Extracting %s...\n", buf);
+    fprintf(STDOUT, "Extracting %s...\n", buf);
 
-    FILE *fh;
     FAIL_IF_PERROR((fh = fopen(buf, "wb")) == NULL, "Failed to create patch.s");
     fputs(patch_s, fh);
+    STATS_OUTPUT(fh);
     fclose(fh);
 
     snprintf(buf, sizeof buf, "%s/%sp.lds", dir, base);
-    printf("Generating %s...\n", buf);
-    FAIL_IF(genlds(3, cmd_argv) != EXIT_SUCCESS, "Failed to create linker script\n");
+    fprintf(STDOUT, "Generating %s...\n", buf);
+    FAIL_IF_PERROR((fh = fopen(buf, "w")) == NULL, "Failed to create linker script");
+    FAIL_IF(genlds_image(&pe, file_basename(argv[1]), split, slack, fh) != EXIT_SUCCESS, "Failed to create linker script\n");
+    STATS_OUTPUT(fh);
+    fclose(fh);
 
     snprintf(buf, sizeof buf, "%s/Makefile", dir);
-    printf("Generating %s...\n", buf);
-    FAIL_IF(genmak(3, cmd_argv) != EXIT_SUCCESS, "Failed to create Makefile\n");
+    fprintf(STDOUT, "Generating %s...\n", buf);
+    FAIL_IF_PERROR((fh = fopen(buf, "w")) == NULL, "Failed to create Makefile");
+    FAIL_IF(genmak_image(&pe, file_basename(argv[1]), split, fh) != EXIT_SUCCESS, "Failed to create Makefile\n");
+    STATS_OUTPUT(fh);
+    fclose(fh);
+    fh = NULL;
 
 cleanup:
+    if (fh) fclose(fh);
+    pe_image_close(&pe);
     return ret;
 }
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64, fast enough to key whole executables by their content
+uint64_t hash64(const void *data, size_t length, uint64_t seed);
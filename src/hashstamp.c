@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pe.h"
+#include "cleanup.h"
+#include "common.h"
+#include "hash.h"
+#include "pe_image.h"
+#include "stats.h"
+
+int re2obj_hash_type(const t_pe_image *pe, const char *type, uint64_t *hash);
+
+/*
+ * Stamps stand in for inputs in generated Makefiles. The stamp holds the hash
+ * of the inputs and is only written when that changes, so make sees it as new
+ * only when the contents are, however often the files themselves are touched.
+ */
+
+// What a section object is made of, not where the section happens to be in the file
+static int hash_section(const char *path, const char *name, uint64_t *hash)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret   = EXIT_SUCCESS;
+    t_pe_image pe    = { 0 };
+    bool       found = false;
+
+    FAIL_IF_SILENT(pe_image_open(&pe, path, MAPFILE_READ, 0));
+
+    for (int i = 0; i < pe.nsections; i++)
+    {
+        const PIMAGE_SECTION_HEADER sct = &pe.sections[i];
+        uint32_t fields[4] = { sct->Misc.VirtualSize, sct->VirtualAddress, sct->SizeOfRawData, sct->Characteristics };
+
+        if (strncmp((char *)sct->Name, name, IMAGE_SIZEOF_SHORT_NAME) != 0)
+            continue;
+
+        FAIL_IF(sct->SizeOfRawData && (uint64_t)sct->PointerToRawData + sct->SizeOfRawData > pe.length,
+                "%s: section %s is outside the file.\n", path, name);
+
+        *hash = hash64(fields, sizeof fields, *hash);
+        *hash = hash64(pe.image + sct->PointerToRawData, sct->SizeOfRawData, *hash);
+        found = true;
+    }
+
+    FAIL_IF(!found, "%s: no section %s.\n", path, name);
+
+cleanup:
+    pe_image_close(&pe);
+    return ret;
+}
+
+// What the object of one resource type is made of
+static int hash_type(const char *path, const char *type, uint64_t *hash)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
+
+    FAIL_IF_SILENT(pe_image_open(&pe, path, MAPFILE_READ, 0));
+    FAIL_IF_SILENT(re2obj_hash_type(&pe, type, hash));
+
+cleanup:
+    pe_image_close(&pe);
+    return ret;
+}
+
+// Chains the contents of the file onto hash
+int hash_file(const char *path, uint64_t *hash)
+{
+    int       ret = EXIT_SUCCESS;
+    t_mapfile map = { 0 };
+
+    FAIL_IF(mapfile_open(&map, path, MAPFILE_READ) != EXIT_SUCCESS, "%s: could not hash.\n", path);
+
+    *hash = hash64(map.image, map.length, *hash);
+
+cleanup:
+    mapfile_close(&map);
+    return ret;
+}
+
+int hashstamp(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int   ret = EXIT_SUCCESS;
+    FILE *fh  = NULL;
+
+    const char *section = opt_value(&argc, argv, "--section");
+    const char *type    = opt_value(&argc, argv, "--type");
+
+    FAIL_IF(argc < 3 || ((section || type) && argc != 3) || (section && type),
+            "usage: petool hashstamp <stamp> <file>... | <stamp> <image> --section <name> | <stamp> <image> --type <type>\n");
+
+    uint64_t hash = 0;
+
+    if (section)
+    {
+        FAIL_IF_SILENT(hash_section(argv[2], section, &hash));
+    }
+    else if (type)
+    {
+        FAIL_IF_SILENT(hash_type(argv[2], type, &hash));
+    }
+    else
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            FAIL_IF_SILENT(hash_file(argv[i], &hash));
+            STATS_COUNT(STATS_RECORDS, 1);
+        }
+    }
+
+    char line[32], old[32] = { '\0' };
+    snprintf(line, sizeof line, "%016"PRIx64"\n", hash);
+
+    fh = fopen(argv[1], "r");
+    if (fh)
+    {
+        if (!fgets(old, sizeof old, fh))
+            old[0] = '\0';
+
+        fclose(fh);
+        fh = NULL;
+    }
+
+    // leave the stamp and its time alone when nothing changed
+    if (strcmp(line, old) == 0)
+        goto cleanup;
+
+    fh = fopen(argv[1], "w");
+    FAIL_IF_PERROR(fh == NULL, "Could not open stamp");
+    FAIL_IF_PERROR(fputs(line, fh) == EOF, "Could not write stamp");
+    STATS_COUNT(STATS_BYTES_WRITTEN, strlen(line));
+
+cleanup:
+    if (fh) fclose(fh);
+    return ret;
+}
@@ -26,34 +26,450 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "stats.h"
+#include "outbuf.h"
+#include "hash.h"
 
-uint32_t rva_to_offset(uint32_t address, PIMAGE_NT_HEADERS nt_hdr)
+/*
+ * The import table is rebuilt from the descriptors, the lookup tables and the
+ * hint/name entries they point to so the generated .idata stands on its own.
+ * The import address tables stay where they are in the original image since
+ * its code calls through them, every slot gets an __imp__ label at its
+ * original address so new code can call through them as well.
+ */
+
+// Every directive is the text before and after its operand
+typedef struct {
+    const char *header;             // image name, image base
+    const char *comment[2];
+    const char *global;
+    const char *equ[3];             // around the label and the IAT slot RVA
+    const char *rva[2];
+    const char *dword;
+    const char *word;
+    const char *string[2];
+    const char *byte;
+    const char *align;
+    const char *end;                // terminating descriptor
+} t_syntax;
+
+static const t_syntax gas_syntax = {
+    "/* Imports for %s */\n.equ ImageBase, 0x%"PRIX32"\n\n.section .idata\n\n",
+    { "/* ", " */" },
+    ".global ",
+    { ".equ ", ", ImageBase + 0x", "\n" },
+    { ".rva ", "" },
+    ".long 0x",
+    ".short 0x",
+    { ".asciz \"", "\"\n" },
+    ".byte 0x",
+    ".balign 2\n",
+    ".long 0, 0, 0, 0, 0 /* END */\n",
+};
+
+static const t_syntax nasm_syntax = {
+    "; Imports for %s\nImageBase equ 0x%"PRIX32"\n\nsection .idata\n\n",
+    { "; ", "" },
+    "global ",
+    { "", " equ ImageBase + 0x", "\n" },
+    { "dd ", " wrt ..imagebase" },
+    "dd 0x",
+    "dw 0x",
+    { "db \"", "\", 0\n" },
+    "db 0x",
+    "align 2, db 0\n",
+    "dd 0, 0, 0, 0, 0 ; END\n",
+};
+
+typedef struct {
+    t_pe_image     *pe;
+    const t_syntax *syn;
+    t_outbuf        out;
+    uint64_t       *labels;     // hashes of the __imp__ labels given out
+    uint32_t        nlabels;
+    uint32_t        size;
+} t_import;
+
+// File data at rva and how much of it is left in its section, NULL if none
+static const int8_t *image_data(t_pe_image *pe, uint32_t rva, uint32_t *avail)
+{
+    uint32_t address = pe->nt_hdr->OptionalHeader.ImageBase + rva;
+    const t_secrange *range = secindex_find(&pe->index, address);
+
+    *avail = 0;
+
+    if (range == NULL)
+        return NULL;
+
+    uint32_t offset = range->offset + (address - range->start);
+
+    if (offset >= pe->length)
+        return NULL;
+
+    *avail = range->end - address;
+
+    if (*avail > pe->length - offset)
+        *avail = pe->length - offset;
+
+    return pe->image + offset;
+}
+
+static const char *image_string(t_pe_image *pe, uint32_t rva)
+{
+    uint32_t avail;
+    const char *str = (const char *)image_data(pe, rva, &avail);
+
+    return str && memchr(str, '\0', avail) ? str : NULL;
+}
+
+// Thunks before the terminator, or the end of the section
+static const uint32_t *image_thunks(t_pe_image *pe, uint32_t rva, uint32_t *count)
+{
+    uint32_t avail;
+    const uint32_t *thunks = (const void *)image_data(pe, rva, &avail);
+
+    for (*count = 0; thunks && *count < avail / 4 && thunks[*count] != 0; (*count)++);
+
+    return thunks;
+}
+
+// Symbol characters both assemblers take, anything else becomes an underscore
+static void put_symbol(char *dst, size_t size, const char *prefix, const char *name, size_t name_len)
+{
+    size_t n = strlen(prefix);
+
+    if (n >= size)
+        n = size - 1;
+
+    memcpy(dst, prefix, n);
+
+    for (size_t i = 0; i < name_len && n < size - 1; i++)
+        dst[n++] = isalnum((unsigned char)name[i]) || name[i] == '@' ? name[i] : '_';
+
+    dst[n] = '\0';
+}
+
+// False if the label was given out before
+static bool claim_label(t_import *imp, const char *label)
 {
-    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    uint64_t hash = hash64(label, strlen(label), 0);
+
+    if (hash == 0)
+        hash = 1;
+
+    if (imp->nlabels * 2 >= imp->size)
+    {
+        uint32_t size = imp->size ? imp->size * 2 : 256;
+        uint64_t *labels = calloc(size, sizeof *labels);
+
+        if (labels == NULL)
+        {
+            imp->out.failed = true;
+            return false;
+        }
+
+        STATS_ALLOC(size * sizeof *labels);
+
+        for (uint32_t i = 0; i < imp->size; i++)
+        {
+            if (imp->labels[i] == 0)
+                continue;
+
+            uint32_t slot = imp->labels[i] & (size - 1);
+            while (labels[slot])
+                slot = (slot + 1) & (size - 1);
+            labels[slot] = imp->labels[i];
+        }
+
+        free(imp->labels);
+        imp->labels = labels;
+        imp->size = size;
+    }
+
+    uint32_t slot = hash & (imp->size - 1);
+
+    for (; imp->labels[slot]; slot = (slot + 1) & (imp->size - 1))
     {
-        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        if (imp->labels[slot] == hash)
+            return false;
+    }
+
+    imp->labels[slot] = hash;
+    imp->nlabels++;
+    return true;
+}
+
+// Label of the tables of one descriptor, a suffix or the index of a thunk
+static void put_local(t_outbuf *out, uint32_t index, const char *suffix, uint32_t thunk)
+{
+    outbuf_write(out, "_import_", 8);
+    outbuf_dec(out, index);
+    outbuf_write(out, "_", 1);
+
+    if (suffix)
+        outbuf_puts(out, suffix);
+    else
+        outbuf_dec(out, thunk);
+}
+
+static void put_label(t_outbuf *out, uint32_t index, const char *suffix, uint32_t thunk)
+{
+    put_local(out, index, suffix, thunk);
+    outbuf_write(out, ":\n", 2);
+}
+
+static void put_comment(t_import *imp, const char *text)
+{
+    outbuf_puts(&imp->out, imp->syn->comment[0]);
+    outbuf_puts(&imp->out, text);
+    outbuf_puts(&imp->out, imp->syn->comment[1]);
+    outbuf_write(&imp->out, "\n", 1);
+}
+
+// Ends a directive started at start with a comment in a column of its own
+static void put_aligned_comment(t_import *imp, size_t start, const char *text)
+{
+    t_outbuf *out = &imp->out;
+
+    if (out->length - start < 36)
+        outbuf_write(out, "                                    ", 36 - (out->length - start));
+
+    put_comment(imp, text);
+}
+
+static void put_rva(t_import *imp, uint32_t index, const char *suffix, uint32_t thunk, const char *comment)
+{
+    size_t start = imp->out.length;
+
+    outbuf_puts(&imp->out, imp->syn->rva[0]);
+    put_local(&imp->out, index, suffix, thunk);
+    outbuf_puts(&imp->out, imp->syn->rva[1]);
+    put_aligned_comment(imp, start, comment);
+}
 
-        if (sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase <= address && address < sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase + sct_hdr->SizeOfRawData)
+static void put_dword(t_import *imp, uint32_t value, const char *comment)
+{
+    size_t start = imp->out.length;
+
+    outbuf_puts(&imp->out, imp->syn->dword);
+    outbuf_hex(&imp->out, value);
+
+    if (comment)
+        put_aligned_comment(imp, start, comment);
+    else
+        outbuf_write(&imp->out, "\n", 1);
+}
+
+static void put_string(t_import *imp, const char *str)
+{
+    for (const char *p = str; *p; p++)
+    {
+        if (*p < 0x20 || *p > 0x7E || *p == '"' || *p == '\\')
         {
-            return sct_hdr->PointerToRawData + (address - (sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase));
+            for (p = str; ; p++)
+            {
+                outbuf_puts(&imp->out, imp->syn->byte);
+                outbuf_hex(&imp->out, (uint8_t)*p);
+                outbuf_write(&imp->out, "\n", 1);
+
+                if (*p == '\0')
+                    return;
+            }
         }
     }
 
-    return 0;
+    outbuf_puts(&imp->out, imp->syn->string[0]);
+    outbuf_puts(&imp->out, str);
+    outbuf_puts(&imp->out, imp->syn->string[1]);
+}
+
+static void put_descriptor(t_import *imp, const IMAGE_IMPORT_DESCRIPTOR *desc, uint32_t index, const char *dll)
+{
+    put_comment(imp, dll);
+    put_rva(imp, index, "ilt", 0, "OriginalFirstThunk");
+    put_dword(imp, 0, "TimeDateStamp");
+    put_dword(imp, 0, "ForwarderChain");
+    put_rva(imp, index, "name", 0, "Name");
+    put_dword(imp, desc->FirstThunk, "FirstThunk");
+}
+
+static void put_slot(t_import *imp, const char *label, uint32_t rva)
+{
+    const t_syntax *syn = imp->syn;
+
+    outbuf_puts(&imp->out, syn->global);
+    outbuf_puts(&imp->out, label);
+    outbuf_write(&imp->out, "\n", 1);
+    outbuf_puts(&imp->out, syn->equ[0]);
+    outbuf_puts(&imp->out, label);
+    outbuf_puts(&imp->out, syn->equ[1]);
+    outbuf_hex(&imp->out, rva);
+    outbuf_puts(&imp->out, syn->equ[2]);
+}
+
+// Lookup table, __imp__ labels of the address table and the hint/name entries
+static uint32_t put_thunks(t_import *imp, const IMAGE_IMPORT_DESCRIPTOR *desc, uint32_t index, const char *dll)
+{
+    char label[300], text[320];
+    uint32_t count;
+
+    // without a lookup table the unbound address table has the names
+    const uint32_t *thunks = image_thunks(imp->pe, desc->OriginalFirstThunk ? desc->OriginalFirstThunk : desc->FirstThunk, &count);
+
+    const char *ext = strrchr(dll, '.');
+    size_t dll_len = ext ? (size_t)(ext - dll) : strlen(dll);
+
+    outbuf_write(&imp->out, "\n", 1);
+    put_comment(imp, dll);
+    put_label(&imp->out, index, "ilt", 0);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *name = NULL;
+
+        if (thunks[i] & 0x80000000)
+        {
+            snprintf(text, sizeof text, "ordinal %"PRIu32, thunks[i] & 0xFFFF);
+            put_dword(imp, thunks[i], text);
+        }
+        else if ((name = image_string(imp->pe, thunks[i] + 2)) != NULL)
+        {
+            put_rva(imp, index, NULL, i, name);
+        }
+        else
+        {
+            put_dword(imp, thunks[i], "invalid hint/name entry");
+        }
+    }
+
+    put_dword(imp, 0, NULL);
+    outbuf_write(&imp->out, "\n", 1);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (thunks[i] & 0x80000000)
+        {
+            snprintf(text, sizeof text, "_%"PRIu32, thunks[i] & 0xFFFF);
+            put_symbol(label, sizeof label, "__imp__", dll, dll_len);
+            strncat(label, text, sizeof label - strlen(label) - 1);
+        }
+        else
+        {
+            const char *name = image_string(imp->pe, thunks[i] + 2);
+
+            if (name == NULL)
+                continue;
+
+            put_symbol(label, sizeof label, "__imp__", name, strlen(name));
+        }
+
+        bool unique = claim_label(imp, label);
+
+        // the same name from another library gets the library name as well
+        if (!unique && !(thunks[i] & 0x80000000))
+        {
+            strcpy(text, label + strlen("__imp__"));
+            put_symbol(label, sizeof label, "__imp__", dll, dll_len);
+            strncat(label, "_", sizeof label - strlen(label) - 1);
+            strncat(label, text, sizeof label - strlen(label) - 1);
+            unique = claim_label(imp, label);
+        }
+
+        if (!unique)
+        {
+            snprintf(text, sizeof text, "duplicate %s", label);
+            put_comment(imp, text);
+            continue;
+        }
+
+        put_slot(imp, label, desc->FirstThunk + i * 4);
+    }
+
+    outbuf_write(&imp->out, "\n", 1);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *name;
+
+        if ((thunks[i] & 0x80000000) || (name = image_string(imp->pe, thunks[i] + 2)) == NULL)
+            continue;
+
+        uint16_t hint;
+        memcpy(&hint, name - 2, sizeof hint);
+
+        put_label(&imp->out, index, NULL, i);
+        outbuf_puts(&imp->out, imp->syn->word);
+        outbuf_hex(&imp->out, hint);
+        outbuf_write(&imp->out, "\n", 1);
+        put_string(imp, name);
+        outbuf_puts(&imp->out, imp->syn->align);
+    }
+
+    put_label(&imp->out, index, "name", 0);
+    put_string(imp, dll);
+    outbuf_puts(&imp->out, imp->syn->align);
+
+    return count;
+}
+
+// Size of the .idata import generates for the image, 0 without an import table
+uint32_t import_size(t_pe_image *pe)
+{
+    PIMAGE_DATA_DIRECTORY imports = pe_image_directory(pe, IMAGE_DIRECTORY_ENTRY_IMPORT);
+    uint32_t avail, ndesc = 0;
+
+    if (imports == NULL || imports->VirtualAddress == 0)
+        return 0;
+
+    const IMAGE_IMPORT_DESCRIPTOR *desc = (const void *)image_data(pe, imports->VirtualAddress, &avail);
+
+    if (desc == NULL)
+        return 0;
+
+    while ((ndesc + 1) * sizeof *desc <= avail && (desc[ndesc].Name != 0 || desc[ndesc].FirstThunk != 0))
+        ndesc++;
+
+    uint32_t size = (ndesc + 1) * sizeof *desc;
+
+    for (uint32_t d = 0; d < ndesc; d++)
+    {
+        const char *dll = image_string(pe, desc[d].Name);
+        uint32_t count;
+
+        if (dll == NULL)
+            continue;
+
+        const uint32_t *thunks = image_thunks(pe, desc[d].OriginalFirstThunk ? desc[d].OriginalFirstThunk : desc[d].FirstThunk, &count);
+
+        // the lookup table, the hint/name entries and the library name, each string aligned to 2
+        size += (count + 1) * 4;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const char *name;
+
+            if (!(thunks[i] & 0x80000000) && (name = image_string(pe, thunks[i] + 2)) != NULL)
+                size += (2 + strlen(name) + 2) & ~1U;
+        }
+
+        size += (strlen(dll) + 2) & ~1U;
+    }
+
+    return size;
 }
 
 int import(int argc, char **argv)
 {
     // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
-    FILE   *ofh   = stdout;
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
+    FILE      *ofh = STDOUT;
+    t_import   imp = { 0 };
 
     FAIL_IF(argc < 2, "usage: petool import <image> [nasm] [ofile]\n");
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "rb"));
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, 0));
 
     if (argc > 3)
     {
@@ -62,72 +478,53 @@ int import(int argc, char **argv)
         FAIL_IF_PERROR(ofh == NULL, "%s");
     }
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+    PIMAGE_NT_HEADERS nt_hdr = pe.nt_hdr;
+    PIMAGE_DATA_DIRECTORY imports = pe_image_directory(&pe, IMAGE_DIRECTORY_ENTRY_IMPORT);
 
-    FAIL_IF (nt_hdr->OptionalHeader.NumberOfRvaAndSizes < 2, "Not enough DataDirectories.\n");
+    FAIL_IF (imports == NULL, "Not enough DataDirectories.\n");
 
-    uint32_t offset = rva_to_offset(nt_hdr->OptionalHeader.ImageBase + nt_hdr->OptionalHeader.DataDirectory[1].VirtualAddress, nt_hdr);
-    IMAGE_IMPORT_DESCRIPTOR *i = (void *)(image + offset);
+    uint32_t avail, ndesc = 0;
+    const IMAGE_IMPORT_DESCRIPTOR *desc = (const void *)image_data(&pe, imports->VirtualAddress, &avail);
+    FAIL_IF(desc == NULL, "Import table is not in any section.\n");
 
-    if (argc > 2 && toupper(argv[2][0]) == 'N') {
-        fprintf(ofh, "; Imports for %s\n", argv[1]);
-        fprintf(ofh, "ImageBase equ 0x%"PRIX32"\n", nt_hdr->OptionalHeader.ImageBase);
-        fprintf(ofh, "\n");
-        fprintf(ofh, "section .idata\n\n");
+    // up to the all zero descriptor or the end of the section
+    while ((ndesc + 1) * sizeof *desc <= avail && (desc[ndesc].Name != 0 || desc[ndesc].FirstThunk != 0))
+        ndesc++;
 
-        while (1) {
-            if (i->Name != 0) {
-                char *name = (char *)(image + rva_to_offset(nt_hdr->OptionalHeader.ImageBase + i->Name, nt_hdr));
-                fprintf(ofh, "; %s\n", name);
-            } else {
-                fprintf(ofh, "; END\n");
-            }
+    imp.pe  = &pe;
+    imp.syn = argc > 2 && toupper(argv[2][0]) == 'N' ? &nasm_syntax : &gas_syntax;
+    outbuf_init(&imp.out, 65536);
 
-            fprintf(ofh, "dd 0x%-8"PRIX32" ; OriginalFirstThunk\n", i->OriginalFirstThunk);
-            fprintf(ofh, "dd 0x%-8"PRIX32" ; TimeDateStamp\n", i->TimeDateStamp);
-            fprintf(ofh, "dd 0x%-8"PRIX32" ; ForwarderChain\n", i->ForwarderChain);
-            fprintf(ofh, "dd 0x%-8"PRIX32" ; Name\n", i->Name);
-            fprintf(ofh, "dd 0x%-8"PRIX32" ; FirstThunk\n", i->FirstThunk);
+    outbuf_printf(&imp.out, imp.syn->header, argv[1], nt_hdr->OptionalHeader.ImageBase);
+    outbuf_puts(&imp.out, "_import_descriptors:\n");
 
-            fprintf(ofh, "\n");
-
-            if (i->OriginalFirstThunk == 0)
-                break;
-            i++;
-        }
-    } else {
-        fprintf(ofh, "/* Imports for %s */\n", argv[1]);
-        fprintf(ofh, ".equ ImageBase, 0x%"PRIX32"\n", nt_hdr->OptionalHeader.ImageBase);
-        fprintf(ofh, "\n");
-        fprintf(ofh, ".section .idata\n\n");
-
-        while (1) {
-            if (i->Name != 0) {
-                char *name = (char *)(image + rva_to_offset(nt_hdr->OptionalHeader.ImageBase + i->Name, nt_hdr));
-                fprintf(ofh, "/* %s */\n", name);
-            } else {
-                fprintf(ofh, "/* END */\n");
-            }
-
-            fprintf(ofh, ".long 0x%-8"PRIX32" /* OriginalFirstThunk */\n", i->OriginalFirstThunk);
-            fprintf(ofh, ".long 0x%-8"PRIX32" /* TimeDateStamp */\n", i->TimeDateStamp);
-            fprintf(ofh, ".long 0x%-8"PRIX32" /* ForwarderChain */\n", i->ForwarderChain);
-            fprintf(ofh, ".long 0x%-8"PRIX32" /* Name */\n", i->Name);
-            fprintf(ofh, ".long 0x%-8"PRIX32" /* FirstThunk */\n", i->FirstThunk);
+    for (uint32_t d = 0; d < ndesc; d++)
+    {
+        const char *dll = image_string(&pe, desc[d].Name);
+        FAIL_IF(dll == NULL, "Import descriptor %"PRIu32" has no valid name.\n", d);
+        put_descriptor(&imp, &desc[d], d, dll);
+    }
 
-            fprintf(ofh, "\n");
+    outbuf_puts(&imp.out, imp.syn->end);
+    outbuf_puts(&imp.out, "_import_descriptors_end:\n");
 
-            if (i->OriginalFirstThunk == 0)
-                break;
-            i++;
-        }
+    for (uint32_t d = 0; d < ndesc; d++)
+    {
+        uint32_t nsymbols = put_thunks(&imp, &desc[d], d, image_string(&pe, desc[d].Name));
+        STATS_COUNT(STATS_RECORDS, nsymbols);
     }
 
+    t_stats_phase phase = STATS_ENTER(STATS_WRITE);
+    ret = outbuf_flush(&imp.out, ofh);
+    STATS_LEAVE(phase);
+
 cleanup:
-    if (image) free(image);
+    outbuf_free(&imp.out);
+    if (imp.labels) free(imp.labels);
+    pe_image_close(&pe);
     if (argc > 3)
     {
+        STATS_OUTPUT(ofh);
         if (ofh)   fclose(ofh);
     }
     return ret;
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cleanup.h"
+#include "common.h"
+#include "journal.h"
+#include "stats.h"
+
+/*
+ * The journal is a sidecar next to a patched image that remembers, for every
+ * record of the last patch run, the bytes it replaced and a hash of the bytes
+ * it wrote. It is a "PTJ2" magic, the CheckSum the image had before it was
+ * patched and an entry count followed by the entries in address order, each
+ * its address, length and hash with the original bytes.
+ *
+ * A new journal is written next to the old one and only replaces it once the
+ * image it describes is safely written, so a failed run keeps the old one.
+ */
+
+#define JOURNAL_MAGIC 0x324A5450 /* PTJ2 */
+
+static bool take(int8_t **p, const int8_t *end, void *dst, uint32_t length)
+{
+    if ((uint64_t)(end - *p) < length)
+        return false;
+
+    if (dst) memcpy(dst, *p, length);
+    *p += length;
+    return true;
+}
+
+// A missing journal is not an error, exists tells the two apart
+int journal_load(t_journal *journal, const char *path, bool *exists)
+{
+    int   ret = EXIT_SUCCESS;
+    FILE *fh  = NULL;
+
+    memset(journal, 0, sizeof *journal);
+    *exists = false;
+
+    fh = fopen(path, "rb");
+
+    if (fh == NULL && errno == ENOENT)
+        goto cleanup;
+
+    FAIL_IF_PERROR(fh == NULL, path);
+
+    *exists = true;
+
+    FAIL_IF_PERROR(fseek(fh, 0L, SEEK_END), path);
+    long length = ftell(fh);
+    FAIL_IF_PERROR(length < 0 || fseek(fh, 0L, SEEK_SET), path);
+
+    journal->data = malloc(length + 1);
+    FAIL_IF(!journal->data, "Failed to allocate memory for journal\n");
+    FAIL_IF_PERROR(length > 0 && fread(journal->data, length, 1, fh) != 1, path);
+    STATS_ALLOC(length + 1);
+    STATS_COUNT(STATS_BYTES_READ, length);
+
+    int8_t *p = journal->data, *end = journal->data + length;
+    uint32_t magic = 0;
+
+    FAIL_IF(!take(&p, end, &magic, sizeof magic) || magic != JOURNAL_MAGIC, "%s: not a patch journal\n", path);
+    FAIL_IF(!take(&p, end, &journal->checksum, sizeof journal->checksum)
+            || !take(&p, end, &journal->nentries, sizeof journal->nentries), "%s: journal is truncated\n", path);
+    FAIL_IF(journal->nentries > (uint64_t)length / 16, "%s: journal is truncated\n", path);
+
+    journal->entries = calloc(journal->nentries + 1, sizeof *journal->entries);
+    FAIL_IF(!journal->entries, "Failed to allocate memory for journal\n");
+
+    for (uint32_t i = 0; i < journal->nentries; i++)
+    {
+        t_journal_entry *entry = &journal->entries[i];
+
+        FAIL_IF(!take(&p, end, &entry->address, sizeof entry->address)
+                || !take(&p, end, &entry->length, sizeof entry->length)
+                || !take(&p, end, &entry->hash, sizeof entry->hash), "%s: journal is truncated\n", path);
+
+        entry->original = p;
+        FAIL_IF(!take(&p, end, NULL, entry->length), "%s: journal is truncated\n", path);
+
+        FAIL_IF(i > 0 && entry->address < entry[-1].address, "%s: journal is not in address order\n", path);
+    }
+
+cleanup:
+    if (fh) fclose(fh);
+    if (ret != EXIT_SUCCESS) journal_free(journal);
+    return ret;
+}
+
+// The entry patching exactly address and length, if any
+const t_journal_entry *journal_find(const t_journal *journal, uint32_t address, uint32_t length)
+{
+    uint32_t lo = 0, hi = journal->nentries;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (journal->entries[mid].address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < journal->nentries && journal->entries[lo].address == address; lo++)
+    {
+        if (journal->entries[lo].length == length)
+            return &journal->entries[lo];
+    }
+
+    return NULL;
+}
+
+static char *new_path(const char *path)
+{
+    char *ret = malloc(strlen(path) + sizeof ".new");
+
+    if (ret)
+        sprintf(ret, "%s.new", path);
+    else
+        fprintf(STDERR, "Failed to allocate memory for journal path\n");
+
+    return ret;
+}
+
+// Entries must be in address order, the journal takes effect with journal_commit
+int journal_write(const char *path, uint32_t checksum, const t_journal_entry *entries, uint32_t count)
+{
+    int   ret   = EXIT_SUCCESS;
+    FILE *fh    = NULL;
+    uint32_t magic = JOURNAL_MAGIC;
+    char *tmp   = new_path(path);
+
+    FAIL_IF_SILENT(tmp == NULL);
+
+    fh = fopen(tmp, "wb");
+    FAIL_IF_PERROR(fh == NULL, tmp);
+
+    FAIL_IF_PERROR(fwrite(&magic, sizeof magic, 1, fh) != 1
+                   || fwrite(&checksum, sizeof checksum, 1, fh) != 1
+                   || fwrite(&count, sizeof count, 1, fh) != 1, path);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const t_journal_entry *entry = &entries[i];
+
+        FAIL_IF_PERROR(fwrite(&entry->address, sizeof entry->address, 1, fh) != 1
+                       || fwrite(&entry->length, sizeof entry->length, 1, fh) != 1
+                       || fwrite(&entry->hash, sizeof entry->hash, 1, fh) != 1
+                       || (entry->length > 0 && fwrite(entry->original, entry->length, 1, fh) != 1), tmp);
+    }
+
+    FAIL_IF_PERROR(fflush(fh) != 0, tmp);
+    STATS_OUTPUT(fh);
+
+cleanup:
+    if (fh) fclose(fh);
+    if (ret != EXIT_SUCCESS && tmp) remove(tmp);
+    if (tmp) free(tmp);
+    return ret;
+}
+
+// Puts the journal written by journal_write in place, if there is one
+int journal_commit(const char *path)
+{
+    int   ret = EXIT_SUCCESS;
+    char *tmp = new_path(path);
+
+    FAIL_IF_SILENT(tmp == NULL);
+
+    if (!file_exists(tmp))
+        goto cleanup;
+
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows
+    FAIL_IF_PERROR(remove(path) != 0 && errno != ENOENT, path);
+#endif
+    FAIL_IF_PERROR(rename(tmp, path) != 0, path);
+
+cleanup:
+    if (tmp) free(tmp);
+    return ret;
+}
+
+// Throws away the journal written by journal_write, the old one stays
+void journal_discard(const char *path)
+{
+    char *tmp = new_path(path);
+
+    if (tmp)
+    {
+        remove(tmp);
+        free(tmp);
+    }
+}
+
+void journal_free(t_journal *journal)
+{
+    if (journal->entries) free(journal->entries);
+    if (journal->data)    free(journal->data);
+    memset(journal, 0, sizeof *journal);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint32_t    address;
+    uint32_t    length;
+    uint64_t    hash;       // hash64 of the bytes the patch wrote
+    int8_t     *original;   // bytes before patching
+} t_journal_entry;
+
+typedef struct {
+    uint32_t         checksum;  // CheckSum of the image before patching
+    t_journal_entry *entries;   // sorted by address
+    uint32_t         nentries;
+    int8_t          *data;      // file contents the entries point into
+} t_journal;
+
+int journal_load(t_journal *journal, const char *path, bool *exists);
+const t_journal_entry *journal_find(const t_journal *journal, uint32_t address, uint32_t length);
+int journal_write(const char *path, uint32_t checksum, const t_journal_entry *entries, uint32_t count);
+int journal_commit(const char *path);
+void journal_discard(const char *path);
+void journal_free(t_journal *journal);
@@ -14,10 +14,26 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "cleanup.h"
 #include "common.h"
+#include "stats.h"
 
 int dump(int argc, char **argv);
 int genlds(int argc, char **argv);
@@ -30,47 +46,483 @@ int import(int argc, char **argv);
 int re2obj(int argc, char **argv);
 int genmak(int argc, char **argv);
 int genprj(int argc, char **argv);
+int checksum(int argc, char **argv);
+int finalize(int argc, char **argv);
+int hashstamp(int argc, char **argv);
+int cache(int argc, char **argv);
+int diff(int argc, char **argv);
+
+typedef struct {
+    const char *name;
+    int       (*run)(int argc, char **argv);
+} t_command;
+
+static const t_command commands[] = {
+    { "dump",      dump      },
+    { "genlds",    genlds    },
+    { "pe2obj",    pe2obj    },
+    { "patch",     patch     },
+    { "setdd",     setdd     },
+    { "setvs",     setvs     },
+    { "export",    export    },
+    { "import",    import    },
+    { "re2obj",    re2obj    },
+    { "genmak",    genmak    },
+    { "genprj",    genprj    },
+    { "checksum",  checksum  },
+    { "finalize",  finalize  },
+    { "hashstamp", hashstamp },
+    { "cache",     cache     },
+    { "diff",      diff      },
+};
+
+static const t_command *find_command(const char *name)
+{
+    for (size_t i = 0; i < sizeof commands / sizeof commands[0]; i++)
+    {
+        if (strcmp(commands[i].name, name) == 0)
+            return &commands[i];
+    }
+
+    return NULL;
+}
 
 void help(char *progname)
 {
     fprintf(stderr, "petool git~%s (c) 2013 - 2017 Toni Spets\n", REV);
     fprintf(stderr, "https://github.com/CnCNet/petool\n\n");
-    fprintf(stderr, "usage: %s <command> [args ...]\n\n", progname);
-    fprintf(stderr, "commands:"                                                 "\n"
-            "    dump   -- dump information about section of executable"        "\n"
-            "    genlds -- generate GNU ld script for re-linking executable"    "\n"
-            "    pe2obj -- convert PE executable into win32 object file"        "\n"
-            "    patch  -- apply a patch set from the .patch section"           "\n"
-            "    setdd  -- set any DataDirectory in PE header"                  "\n"
-            "    setvs  -- set VirtualSize for a section"                       "\n"
-            "    export -- export section data as raw binary"                   "\n"
-            "    import -- dump the import table as assembly"                   "\n"
-            "    re2obj -- convert the resource section into COFF object"       "\n"
-            "    genmak -- generate project Makefile"                           "\n"
-            "    genprj -- generate full project directory"                     "\n"
-            "    help   -- this information"                                    "\n"
+    fprintf(stderr, "usage: %s [--stats | --stats=json] <command> [args ...]\n\n", progname);
+    fprintf(stderr, "commands:"                                                      "\n"
+            "    dump      -- dump information about section of executable"          "\n"
+            "    genlds    -- generate GNU ld script for re-linking executable"      "\n"
+            "    pe2obj    -- convert PE executable into win32 object file"          "\n"
+            "    patch     -- apply a patch set from the .patch section"             "\n"
+            "    setdd     -- set any DataDirectory in PE header"                    "\n"
+            "    setvs     -- set VirtualSize for a section"                         "\n"
+            "    export    -- export section data as raw binary"                     "\n"
+            "    import    -- dump the import table as assembly"                     "\n"
+            "    re2obj    -- convert the resource section into COFF object"         "\n"
+            "    genmak    -- generate project Makefile"                             "\n"
+            "    genprj    -- generate full project directory"                       "\n"
+            "    checksum  -- verify the PE header CheckSum"                         "\n"
+            "    finalize  -- set imports, patch and strip .patch in one pass"       "\n"
+            "    hashstamp -- update a stamp file when the contents of files change" "\n"
+            "    cache     -- restore or keep finished executables by their inputs"  "\n"
+            "    diff      -- turn the differences of two images into patches"       "\n"
+            "    batch     -- run a command over many images in parallel"            "\n"
+            "    help      -- this information"                                      "\n"
     );
 }
 
+/*
+ * Batch mode runs one command over many images on a pool of worker threads.
+ * Each job prints into its own temporary files which the main thread copies
+ * out in input order, so the output is the same as running the images one by
+ * one. Workers only start a job within a window of the oldest job not yet
+ * printed, which bounds the images mapped and the output held at any time.
+ */
+
+typedef struct {
+    char   *path;
+    FILE   *out;
+    FILE   *err;
+    int     ret;
+    bool    done;
+} t_job;
+
+typedef struct {
+    const t_command    *command;
+    char              **args;       // passed after the image
+    int                 nargs;
+    t_job              *jobs;
+    size_t              njobs;
+    size_t              next;       // next job to start
+    size_t              printed;    // jobs already copied out
+    size_t              window;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+} t_batch;
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+    const char *n = getenv("NUMBER_OF_PROCESSORS");
+    return n && atoi(n) > 0 ? atoi(n) : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static bool is_image_name(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    if (ext == NULL || strlen(ext) != 4)
+        return false;
+
+    char lower[5];
+    for (int i = 0; i < 5; i++)
+        lower[i] = tolower((unsigned char)ext[i]);
+
+    return strcmp(lower, ".exe") == 0 || strcmp(lower, ".dll") == 0;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcmp(((const t_job *)a)->path, ((const t_job *)b)->path);
+}
+
+static int add_job(t_batch *batch, size_t *size, const char *path)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (batch->njobs == *size)
+    {
+        *size = *size ? *size * 2 : 64;
+        t_job *jobs = realloc(batch->jobs, *size * sizeof *jobs);
+        FAIL_IF(!jobs, "Failed to allocate memory for batch jobs\n");
+        batch->jobs = jobs;
+    }
+
+    t_job *job = &batch->jobs[batch->njobs];
+    memset(job, 0, sizeof *job);
+
+    job->path = malloc(strlen(path) + 1);
+    FAIL_IF(!job->path, "Failed to allocate memory for batch jobs\n");
+    strcpy(job->path, path);
+
+    batch->njobs++;
+
+cleanup:
+    return ret;
+}
+
+// Images of a directory in name order, not recursing
+static int add_directory(t_batch *batch, size_t *size, const char *dir)
+{
+    int     ret   = EXIT_SUCCESS;
+    DIR    *dh    = NULL;
+    char   *path  = NULL;
+    size_t  first = batch->njobs;
+    struct dirent *ent;
+
+    dh = opendir(dir);
+    FAIL_IF_PERROR(dh == NULL, dir);
+
+    while ((ent = readdir(dh)) != NULL)
+    {
+        if (!is_image_name(ent->d_name))
+            continue;
+
+        path = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+        FAIL_IF(!path, "Failed to allocate memory for batch jobs\n");
+        sprintf(path, "%s/%s", dir, ent->d_name);
+
+        FAIL_IF_SILENT(add_job(batch, size, path));
+
+        free(path);
+        path = NULL;
+    }
+
+    qsort(batch->jobs + first, batch->njobs - first, sizeof *batch->jobs, path_cmp);
+
+cleanup:
+    if (path) free(path);
+    if (dh)   closedir(dh);
+    return ret;
+}
+
+// One image per line, empty lines and lines starting with # are skipped
+static int add_list(t_batch *batch, size_t *size, const char *list)
+{
+    int   ret = EXIT_SUCCESS;
+    FILE *fh  = NULL;
+    char  line[4096];
+
+    fh = fopen(list, "r");
+    FAIL_IF_PERROR(fh == NULL, list);
+
+    while (fgets(line, sizeof line, fh))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        FAIL_IF_SILENT(add_job(batch, size, line));
+    }
+
+cleanup:
+    if (fh) fclose(fh);
+    return ret;
+}
+
+static void run_job(t_batch *batch, t_job *job)
+{
+    char **argv = calloc(batch->nargs + 3, sizeof *argv);
+
+    job->out = tmpfile();
+    job->err = tmpfile();
+
+    if (!argv || !job->out || !job->err)
+    {
+        fprintf(stderr, "%s: Failed to set up batch job\n", job->path);
+        job->ret = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    argv[0] = (char *)batch->command->name;
+    argv[1] = job->path;
+    memcpy(argv + 2, batch->args, batch->nargs * sizeof *argv);
+
+    cmd_stdout = job->out;
+    cmd_stderr = job->err;
+
+    if (stats_mode)
+        stats_start();
+
+    job->ret = batch->command->run(batch->nargs + 2, argv);
+
+    if (stats_mode)
+    {
+        stats_output(job->out);
+        stats_report(job->err, batch->command->name);
+    }
+
+    cmd_stdout = NULL;
+    cmd_stderr = NULL;
+
+cleanup:
+    if (argv) free(argv);
+}
+
+static void *worker(void *arg)
+{
+    t_batch *batch = arg;
+
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->next < batch->njobs)
+    {
+        if (batch->next >= batch->printed + batch->window)
+        {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+            continue;
+        }
+
+        t_job *job = &batch->jobs[batch->next++];
+
+        pthread_mutex_unlock(&batch->lock);
+        run_job(batch, job);
+        pthread_mutex_lock(&batch->lock);
+
+        job->done = true;
+        pthread_cond_broadcast(&batch->cond);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Copies captured output, prefixing every line with the image it is about
+static void copy_output(FILE *from, FILE *to, const char *prefix)
+{
+    char buf[4096];
+    bool line_start = true;
+
+    if (from == NULL)
+        return;
+
+    rewind(from);
+
+    // output may be binary, only stderr is taken apart into lines
+    if (prefix == NULL)
+    {
+        size_t n;
+
+        while ((n = fread(buf, 1, sizeof buf, from)) > 0)
+            fwrite(buf, 1, n, to);
+
+        return;
+    }
+
+    while (fgets(buf, sizeof buf, from))
+    {
+        if (prefix && line_start)
+            fprintf(to, "%s: ", prefix);
+
+        fputs(buf, to);
+        line_start = buf[strlen(buf) - 1] == '\n';
+    }
+}
+
+static int batch(int argc, char **argv)
+{
+    int        ret      = EXIT_SUCCESS;
+    t_batch    batch    = { 0 };
+    pthread_t *threads  = NULL;
+    int        nthreads = cpu_count();
+    int        started  = 0;
+    size_t     size     = 0;
+    size_t     failed   = 0;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    int i = 1;
+
+    if (i < argc && strncmp(argv[i], "-j", 2) == 0)
+    {
+        nthreads = atoi(argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "0"));
+        i++;
+    }
+
+    FAIL_IF(nthreads < 1 || i + 1 >= argc, "usage: petool batch [-j <threads>] <command> <image|directory|@list>... [-- <args>...]\n");
+
+    batch.command = find_command(argv[i]);
+    FAIL_IF(batch.command == NULL, "Unknown command: %s\n", argv[i]);
+
+    for (i++; i < argc && strcmp(argv[i], "--") != 0; i++)
+    {
+        struct stat st;
+
+        if (argv[i][0] == '@')
+        {
+            FAIL_IF_SILENT(add_list(&batch, &size, argv[i] + 1));
+        }
+        else if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            FAIL_IF_SILENT(add_directory(&batch, &size, argv[i]));
+        }
+        else
+        {
+            FAIL_IF_SILENT(add_job(&batch, &size, argv[i]));
+        }
+    }
+
+    if (i < argc)
+    {
+        batch.args  = argv + i + 1;
+        batch.nargs = argc - i - 1;
+    }
+
+    if ((size_t)nthreads > batch.njobs)
+        nthreads = batch.njobs > 0 ? batch.njobs : 1;
+
+    batch.window = nthreads * 2;
+
+    threads = calloc(nthreads, sizeof *threads);
+    FAIL_IF(!threads, "Failed to allocate memory for batch threads\n");
+
+    for (; started < nthreads; started++)
+    {
+        FAIL_IF(pthread_create(&threads[started], NULL, worker, &batch) != 0, "Failed to start batch thread\n");
+    }
+
+    for (size_t j = 0; j < batch.njobs; j++)
+    {
+        t_job *job = &batch.jobs[j];
+
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done)
+            pthread_cond_wait(&batch.cond, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        printf("==> %s <==\n", job->path);
+        copy_output(job->out, stdout, NULL);
+        copy_output(job->err, stderr, job->path);
+        fflush(stdout);
+
+        if (job->out) fclose(job->out);
+        if (job->err) fclose(job->err);
+        job->out = job->err = NULL;
+
+        if (job->ret != EXIT_SUCCESS)
+            failed++;
+
+        pthread_mutex_lock(&batch.lock);
+        batch.printed++;
+        pthread_cond_broadcast(&batch.cond);
+        pthread_mutex_unlock(&batch.lock);
+    }
+
+    FAIL_IF(failed > 0, "batch: %zu of %zu images failed\n", failed, batch.njobs);
+
+cleanup:
+    // workers only exit once every job is taken
+    if (ret != EXIT_SUCCESS)
+    {
+        pthread_mutex_lock(&batch.lock);
+        batch.next = batch.njobs;
+        batch.printed = batch.njobs;
+        pthread_cond_broadcast(&batch.cond);
+        pthread_mutex_unlock(&batch.lock);
+    }
+
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    for (size_t j = 0; j < batch.njobs; j++)
+    {
+        if (batch.jobs[j].out) fclose(batch.jobs[j].out);
+        if (batch.jobs[j].err) fclose(batch.jobs[j].err);
+        free(batch.jobs[j].path);
+    }
+
+    if (batch.jobs) free(batch.jobs);
+    if (threads)    free(threads);
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.lock);
+    return ret;
+}
+
+static int run_command(const char *name, int (*run)(int argc, char **argv), int argc, char **argv)
+{
+    if (!stats_mode)
+        return run(argc, argv);
+
+    stats_start();
+    int ret = run(argc, argv);
+    fflush(stdout);
+    stats_output(stdout);
+    stats_report(stderr, name);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
+    const t_command *command;
+
+    // only before the command name, anything after it belongs to the command
+    while (argc > 1 && strncmp(argv[1], "--stats", 7) == 0)
+    {
+        if (strcmp(argv[1], "--stats") == 0)
+            stats_mode = STATS_TEXT;
+        else if (strcmp(argv[1], "--stats=json") == 0)
+            stats_mode = STATS_JSON;
+        else
+            break;
+
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     if (argc < 2)
     {
         help(argv[0]);
         fprintf(stderr, "\nNo command given: please give valid command name as first argument\n\n");
         return EXIT_FAILURE;
     }
-    else if (strcmp(argv[1], "dump")   == 0) return dump   (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "genlds") == 0) return genlds (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "pe2obj") == 0) return pe2obj (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "patch")  == 0) return patch  (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "setdd")  == 0) return setdd  (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "setvs")  == 0) return setvs  (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "export") == 0) return export (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "import") == 0) return import (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "re2obj") == 0) return re2obj (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "genmak") == 0) return genmak (argc - 1, argv + 1);
-    else if (strcmp(argv[1], "genprj") == 0) return genprj (argc - 1, argv + 1);
+    else if ((command = find_command(argv[1])) != NULL)
+    {
+        return run_command(command->name, command->run, argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "batch") == 0)
+    {
+        return run_command("batch", batch, argc - 1, argv + 1);
+    }
     else if (strcmp(argv[1], "help")   == 0)
     {
         help(argv[0]);
@@ -81,7 +533,7 @@ int main(int argc, char **argv)
         if (file_exists(argv[1]))
         {
             char *cmd_argv[2] = { "genprj", argv[1] };
-            return genprj(2, cmd_argv);
+            return run_command("genprj", genprj, 2, cmd_argv);
         }
 
         fprintf(stderr, "Unknown command: %s\n", argv[1]);
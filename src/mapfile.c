@@ -0,0 +1,311 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "cleanup.h"
+#include "mapfile.h"
+#include "stats.h"
+
+/*
+ * Executables are mapped privately even when they are going to be updated so
+ * a command failing half way through never leaves a partially modified file
+ * behind. Modified pages are recorded with mapfile_dirty() and only runs of
+ * those are written back by mapfile_sync(). Streams and systems without mmap() fall back
+ * to reading the whole file into memory.
+ */
+
+static bool map_file(t_mapfile *map)
+{
+#ifndef _WIN32
+    struct stat st;
+
+    if (fstat(fileno(map->fh), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    if (st.st_size <= 0 || (uintmax_t)st.st_size > UINT32_MAX)
+        return false;
+
+    void *p = mmap(NULL, st.st_size,
+                   map->mode == MAPFILE_READ ? PROT_READ : PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, fileno(map->fh), 0);
+
+    if (p == MAP_FAILED)
+        return false;
+
+    map->image  = p;
+    map->length = map->size = st.st_size;
+    map->mapped = true;
+    return true;
+#else
+    (void)map;
+    return false;
+#endif
+}
+
+static int read_stream(t_mapfile *map)
+{
+    int ret = EXIT_SUCCESS;
+    size_t size = 0, alloc = 65536, numread;
+    int8_t *buf = NULL;
+
+    for (;;)
+    {
+        int8_t *tmp = realloc(buf, alloc);
+        FAIL_IF(!tmp, "Failed to allocate memory to read executable with\n");
+        STATS_ALLOC(alloc);
+        buf = tmp;
+
+        numread = fread(buf + size, 1, alloc - size, map->fh);
+        size += numread;
+
+        if (size < alloc)
+            break;
+
+        FAIL_IF(alloc > UINT32_MAX / 2, "Executable too large\n");
+        alloc *= 2;
+    }
+
+    FAIL_IF_PERROR(ferror(map->fh), "Error reading executable");
+
+    map->image  = buf;
+    map->length = map->size = size;
+    buf = NULL;
+
+cleanup:
+    if (buf) free(buf);
+    return ret;
+}
+
+static int read_file(t_mapfile *map)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (fseek(map->fh, 0L, SEEK_END) != 0)
+    {
+        FAIL_IF_PERROR(map->mode == MAPFILE_UPDATE,
+                       "Need seekable file for executable, not stream");
+        return read_stream(map);
+    }
+
+    long len = ftell(map->fh);
+    FAIL_IF_PERROR(len < 0, "Need seekable file for executable, not stream");
+    rewind(map->fh);
+
+    map->image = malloc(len ? len : 1);
+    FAIL_IF(!map->image, "Failed to allocate memory to read executable with\n");
+    STATS_ALLOC(len);
+
+    FAIL_IF_PERROR(len && fread(map->image, len, 1, map->fh) != 1, "Error reading executable");
+
+    map->length = map->size = len;
+
+cleanup:
+    return ret;
+}
+
+// Caller cleans up with mapfile_close() whether or not this succeeds
+int mapfile_open(t_mapfile *map, const char *path, int mode)
+{
+    int ret = EXIT_SUCCESS;
+    t_stats_phase phase = STATS_ENTER(STATS_READ);
+
+    memset(map, 0, sizeof *map);
+    map->mode = mode;
+
+    map->fh = fopen(path, mode == MAPFILE_UPDATE ? "r+b" : "rb");
+    FAIL_IF_PERROR(!map->fh, "Could not open executable");
+
+    if (!map_file(map))
+    {
+        FAIL_IF_SILENT(read_file(map));
+    }
+
+    STATS_COUNT(STATS_BYTES_READ, map->length);
+
+    // only updates need the handle after this
+    if (mode != MAPFILE_UPDATE)
+    {
+        fclose(map->fh);
+        map->fh = NULL;
+    }
+    else
+    {
+        map->dirty = calloc((map->length + MAPFILE_PAGE - 1) / MAPFILE_PAGE / 8 + 1, 1);
+        FAIL_IF(!map->dirty, "Failed to allocate memory to track changes with\n");
+        STATS_ALLOC((map->length + MAPFILE_PAGE - 1) / MAPFILE_PAGE / 8 + 1);
+    }
+
+cleanup:
+    STATS_LEAVE(phase);
+    return ret;
+}
+
+/*
+ * Opens the file without reading any of it. mapfile_head() then reads as much
+ * from the start as is asked for and the handle stays open for the rest.
+ */
+int mapfile_open_head(t_mapfile *map, const char *path)
+{
+    int ret = EXIT_SUCCESS;
+
+    memset(map, 0, sizeof *map);
+    map->mode = MAPFILE_READ;
+
+    map->fh = fopen(path, "rb");
+    FAIL_IF_PERROR(!map->fh, "Could not open executable");
+
+cleanup:
+    return ret;
+}
+
+// Stops short of length at the end of the file
+int mapfile_head(t_mapfile *map, uint32_t length)
+{
+    int ret = EXIT_SUCCESS;
+    t_stats_phase phase = STATS_ENTER(STATS_READ);
+
+    if (length <= map->length)
+        goto cleanup;
+
+    int8_t *image = realloc(map->image, length);
+    FAIL_IF(!image, "Failed to allocate memory to read executable with\n");
+    STATS_ALLOC(length);
+
+    map->image = image;
+
+    FAIL_IF_PERROR(fseek(map->fh, map->length, SEEK_SET) != 0, "Error reading executable");
+    size_t numread = fread(map->image + map->length, 1, length - map->length, map->fh);
+    FAIL_IF_PERROR(ferror(map->fh), "Error reading executable");
+
+    STATS_COUNT(STATS_BYTES_READ, numread);
+    map->length += numread;
+    map->size = length;
+
+cleanup:
+    STATS_LEAVE(phase);
+    return ret;
+}
+
+void mapfile_dirty(t_mapfile *map, const void *p, uint32_t length)
+{
+    if (map->mode != MAPFILE_UPDATE || length == 0)
+        return;
+
+    uint32_t start = (const int8_t *)p - map->image;
+    uint32_t first = start / MAPFILE_PAGE;
+    uint32_t last  = (start + length - 1) / MAPFILE_PAGE;
+
+    for (uint32_t page = first; page <= last; page++)
+        map->dirty[page >> 3] |= 1 << (page & 7);
+}
+
+// Drops everything from length onwards when the file is synced
+void mapfile_truncate(t_mapfile *map, uint32_t length)
+{
+    if (length < map->length)
+        map->length = length;
+}
+
+static int write_range(t_mapfile *map, uint32_t start, uint32_t end)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (end > map->length)
+        end = map->length;
+
+    FAIL_IF_PERROR(fseek(map->fh, start, SEEK_SET) != 0, "Error writing executable");
+    FAIL_IF_PERROR(fwrite(map->image + start, end - start, 1, map->fh) != 1, "Error writing executable");
+    STATS_COUNT(STATS_BYTES_WRITTEN, end - start);
+
+cleanup:
+    return ret;
+}
+
+#define PAGE_DIRTY(map, page) ((map)->dirty[(page) >> 3] & (1 << ((page) & 7)))
+
+int mapfile_sync(t_mapfile *map)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (map->mode != MAPFILE_UPDATE)
+        return ret;
+
+    t_stats_phase phase = STATS_ENTER(STATS_WRITE);
+
+    uint32_t npages = (map->length + MAPFILE_PAGE - 1) / MAPFILE_PAGE;
+    bool written = false;
+
+    for (uint32_t page = 0; page < npages; page++)
+    {
+        // skip clean pages a byte at a time
+        if ((page & 7) == 0 && map->dirty[page >> 3] == 0)
+        {
+            page += 7;
+            continue;
+        }
+
+        if (!PAGE_DIRTY(map, page))
+            continue;
+
+        uint32_t first = page;
+
+        while (page + 1 < npages && PAGE_DIRTY(map, page + 1))
+            page++;
+
+        FAIL_IF_SILENT(write_range(map, first * MAPFILE_PAGE, (page + 1) * MAPFILE_PAGE));
+        written = true;
+    }
+
+    if (written || map->length < map->size)
+    {
+        FAIL_IF_PERROR(fflush(map->fh) != 0, "Error writing executable");
+    }
+
+    if (map->length < map->size)
+    {
+#ifndef _WIN32
+        FAIL_IF_PERROR(ftruncate(fileno(map->fh), map->length) != 0, "Error truncating executable");
+#else
+        FAIL_IF_PERROR(_chsize(_fileno(map->fh), map->length) != 0, "Error truncating executable");
+#endif
+    }
+
+    memset(map->dirty, 0, (npages + 7) / 8);
+
+cleanup:
+    STATS_LEAVE(phase);
+    return ret;
+}
+
+void mapfile_close(t_mapfile *map)
+{
+    if (map->image)
+    {
+#ifndef _WIN32
+        if (map->mapped)
+            munmap(map->image, map->size);
+        else
+#endif
+            free(map->image);
+    }
+
+    if (map->fh) fclose(map->fh);
+    if (map->dirty) free(map->dirty);
+
+    memset(map, 0, sizeof *map);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+    MAPFILE_READ,       // read-only view
+    MAPFILE_COPY,       // writable view, changes are never written back
+    MAPFILE_UPDATE,     // writable view, dirty ranges written back on sync
+};
+
+#define MAPFILE_PAGE 4096
+
+typedef struct {
+    FILE       *fh;
+    int8_t     *image;
+    uint32_t    length;
+    uint32_t    size;       // of the mapping, length may be truncated below it
+    int         mode;
+    bool        mapped;
+    uint8_t    *dirty;      // one bit per MAPFILE_PAGE
+} t_mapfile;
+
+int mapfile_open(t_mapfile *map, const char *path, int mode);
+int mapfile_open_head(t_mapfile *map, const char *path);
+int mapfile_head(t_mapfile *map, uint32_t length);
+void mapfile_dirty(t_mapfile *map, const void *p, uint32_t length);
+void mapfile_truncate(t_mapfile *map, uint32_t length);
+int mapfile_sync(t_mapfile *map);
+void mapfile_close(t_mapfile *map);
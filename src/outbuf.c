@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "cleanup.h"
+#include "outbuf.h"
+#include "stats.h"
+
+/*
+ * Generated text and objects are built in one growing buffer instead of going
+ * through stdio a field at a time. Allocation failures are remembered and
+ * reported once by outbuf_flush() so the formatting code stays free of checks.
+ */
+
+void outbuf_init(t_outbuf *buf, size_t size)
+{
+    memset(buf, 0, sizeof *buf);
+    buf->data = malloc(size ? size : 1);
+    buf->size = buf->data ? (size ? size : 1) : 0;
+    buf->failed = buf->data == NULL;
+    STATS_ALLOC(buf->size);
+}
+
+// Room for length more bytes, NULL if it can't be had
+char *outbuf_reserve(t_outbuf *buf, size_t length)
+{
+    if (buf->failed)
+        return NULL;
+
+    if (buf->size - buf->length < length)
+    {
+        size_t size = buf->size ? buf->size : 1;
+
+        while (size - buf->length < length)
+            size *= 2;
+
+        char *data = realloc(buf->data, size);
+
+        if (data == NULL)
+        {
+            buf->failed = true;
+            return NULL;
+        }
+
+        STATS_ALLOC(size);
+        buf->data = data;
+        buf->size = size;
+    }
+
+    return buf->data + buf->length;
+}
+
+void outbuf_write(t_outbuf *buf, const void *data, size_t length)
+{
+    char *p = outbuf_reserve(buf, length);
+
+    if (p)
+    {
+        memcpy(p, data, length);
+        buf->length += length;
+    }
+}
+
+void outbuf_puts(t_outbuf *buf, const char *str)
+{
+    outbuf_write(buf, str, strlen(str));
+}
+
+void outbuf_printf(t_outbuf *buf, const char *fmt, ...)
+{
+    va_list args;
+    size_t room = buf->size - buf->length;
+
+    va_start(args, fmt);
+    int n = buf->failed ? -1 : vsnprintf(buf->data + buf->length, room, fmt, args);
+    va_end(args);
+
+    if (n < 0)
+    {
+        buf->failed = true;
+        return;
+    }
+
+    // didn't fit, grow and format again
+    if ((size_t)n >= room)
+    {
+        char *p = outbuf_reserve(buf, n + 1);
+
+        if (p == NULL)
+            return;
+
+        va_start(args, fmt);
+        vsnprintf(p, n + 1, fmt, args);
+        va_end(args);
+    }
+
+    buf->length += n;
+}
+
+// Upper case hex without leading zeros, the hot paths use these over printf
+void outbuf_hex(t_outbuf *buf, uint32_t value)
+{
+    char tmp[8];
+    int n = 0;
+
+    do {
+        tmp[sizeof tmp - ++n] = "0123456789ABCDEF"[value & 0xF];
+        value >>= 4;
+    } while (value);
+
+    outbuf_write(buf, tmp + sizeof tmp - n, n);
+}
+
+void outbuf_dec(t_outbuf *buf, uint32_t value)
+{
+    char tmp[10];
+    int n = 0;
+
+    do {
+        tmp[sizeof tmp - ++n] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    outbuf_write(buf, tmp + sizeof tmp - n, n);
+}
+
+int outbuf_flush(t_outbuf *buf, FILE *fh)
+{
+    int ret = EXIT_SUCCESS;
+
+    FAIL_IF(buf->failed, "Failed to allocate memory for output\n");
+    FAIL_IF_PERROR(buf->length > 0 && fwrite(buf->data, buf->length, 1, fh) != 1, "Error writing output");
+
+    buf->length = 0;
+
+cleanup:
+    return ret;
+}
+
+void outbuf_free(t_outbuf *buf)
+{
+    if (buf->data) free(buf->data);
+    memset(buf, 0, sizeof *buf);
+}
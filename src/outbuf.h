@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Output collected in memory and written with a single fwrite
+typedef struct {
+    char       *data;
+    size_t      length;
+    size_t      size;
+    bool        failed;     // an allocation failed, flush reports it
+} t_outbuf;
+
+void outbuf_init(t_outbuf *buf, size_t size);
+char *outbuf_reserve(t_outbuf *buf, size_t length);
+void outbuf_write(t_outbuf *buf, const void *data, size_t length);
+void outbuf_puts(t_outbuf *buf, const char *str);
+void outbuf_printf(t_outbuf *buf, const char *fmt, ...);
+void outbuf_hex(t_outbuf *buf, uint32_t value);
+void outbuf_dec(t_outbuf *buf, uint32_t value);
+int outbuf_flush(t_outbuf *buf, FILE *fh);
+void outbuf_free(t_outbuf *buf);
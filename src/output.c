@@ -0,0 +1,11 @@
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+ * The streams commands print to, kept apart from the rest of common.c so
+ * anything that includes cleanup.h, like the benchmark harness, links them
+ * without pulling in petool itself.
+ */
+__thread FILE *cmd_stdout;
+__thread FILE *cmd_stderr;
@@ -21,112 +21,675 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <ctype.h>
-#include <unistd.h>
 
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "checksum.h"
+#include "hash.h"
+#include "stats.h"
+#include "journal.h"
 
-int patch_image(int8_t *image, uint32_t address, int8_t *patch, uint32_t length)
+typedef struct {
+    uint32_t            address;
+    uint32_t            length;
+    int8_t             *data;
+    uint32_t            index;      // position in the patch section
+    const t_secrange   *range;      // section the address is in
+    bool                written;    // not left alone thanks to the journal
+} t_patch;
+
+typedef struct {
+    uint32_t    records;
+    uint32_t    runs;
+    uint32_t    bytes;
+    uint32_t    unchanged;          // skipped thanks to the journal
+    uint32_t    reverted;           // journal entries restored
+} t_patch_stats;
+
+static int8_t *patch_target(const t_mapfile *map, const t_secrange *range, uint32_t address)
+{
+    return map->image + range->offset + (address - range->start);
+}
+
+static void write_bytes(t_mapfile *map, t_checksum *ck, int8_t *dst, const void *src, uint32_t length)
+{
+    if (ck) checksum_remove(ck, map->image, map->length, dst, length);
+    memcpy(dst, src, length);
+    if (ck) checksum_add(ck, map->image, map->length, dst, length);
+
+    mapfile_dirty(map, dst, length);
+}
+
+// Puts back the original bytes of a journal entry, false if it doesn't fit the image
+static bool restore_entry(t_pe_image *pe, t_checksum *ck, const t_journal_entry *entry)
+{
+    const t_secrange *range = secindex_find(&pe->index, entry->address);
+
+    // like the record it was journaled for it may run past the section but not the file
+    if (range == NULL || range->offset + ((uint64_t)entry->address + entry->length - range->start) > pe->length)
+    {
+        fprintf(STDERR, "Error: journal entry at %08"PRIX32" (%"PRIu32" bytes) doesn't fit the image\n", entry->address, entry->length);
+        return false;
+    }
+
+    int8_t *dst = patch_target(&pe->map, range, entry->address);
+
+    if (memcmp(dst, entry->original, entry->length) != 0)
+        write_bytes(&pe->map, ck, dst, entry->original, entry->length);
+
+    return true;
+}
+
+/*
+ * Writes sorted[0..count) which are contiguous in memory and in the same
+ * section as one run, so the checksum and the dirty pages are updated once
+ * for the whole run instead of once per record.
+ */
+static void patch_run(t_mapfile *map, t_checksum *ck, t_patch *records, const uint64_t *sorted, uint32_t count, t_patch_stats *stats)
+{
+    const t_patch *first = &records[(uint32_t)sorted[0]];
+    const t_patch *last  = &records[(uint32_t)sorted[count - 1]];
+    uint32_t length = last->address + last->length - first->address;
+
+    int8_t *dst = patch_target(map, first->range, first->address);
+
+    if (ck) checksum_remove(ck, map->image, map->length, dst, length);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        t_patch *rec = &records[(uint32_t)sorted[i]];
+        memcpy(dst + (rec->address - first->address), rec->data, rec->length);
+        rec->written = true;
+    }
+
+    if (ck) checksum_add(ck, map->image, map->length, dst, length);
+
+    mapfile_dirty(map, dst, length);
+
+    stats->records += count;
+    stats->runs++;
+    stats->bytes += length;
+}
+
+/*
+ * Orders records by address with an LSD radix sort over the address bytes of
+ * keys holding the address above the record index. The passes are stable so
+ * records at the same address stay in section order, and a pass is skipped
+ * when every key has the same byte, which is the common case for the top one.
+ */
+static void sort_records(uint64_t *keys, uint64_t *tmp, uint32_t nrecords)
+{
+    for (int shift = 32; shift < 64; shift += 8)
+    {
+        uint32_t count[256] = { 0 };
+
+        for (uint32_t i = 0; i < nrecords; i++)
+            count[(keys[i] >> shift) & 0xFF]++;
+
+        if (nrecords == 0 || count[(keys[0] >> shift) & 0xFF] == nrecords)
+            continue;
+
+        for (uint32_t i = 0, sum = 0; i < 256; i++)
+        {
+            uint32_t c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+
+        for (uint32_t i = 0; i < nrecords; i++)
+            tmp[count[(keys[i] >> shift) & 0xFF]++] = keys[i];
+
+        memcpy(keys, tmp, nrecords * sizeof *keys);
+    }
+}
+
+/*
+ * Each record should lie within the raw data of one section. One running past
+ * it has always been written over whatever follows in the file, so that is a
+ * warning counted in crossing and only an error when strict. Records outside
+ * every section, longer than their section or past the end of the file are
+ * always errors.
+ */
+static uint32_t check_bounds(t_pe_image *pe, const t_patch *records, uint32_t nrecords, bool strict, uint32_t *crossing)
 {
-    PIMAGE_DOS_HEADER dos_hdr       = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr        = (PIMAGE_NT_HEADERS)(image + dos_hdr->e_lfanew);
+    uint32_t errors = 0;
+    const char *level = strict ? "Error" : "Warning";
 
-    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    for (uint32_t i = 0; i < nrecords; i++)
     {
-        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        const t_patch *rec = &records[i];
+        uint64_t end = (uint64_t)rec->address + rec->length;
+
+        if (rec->range == NULL)
+        {
+            fprintf(STDERR, "Error: memory address %08"PRIX32" not found in image\n", rec->address);
+            errors++;
+            continue;
+        }
+
+        if (end <= rec->range->end)
+            continue;
 
-        if (sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase <= address && address < sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase + sct_hdr->SizeOfRawData)
+        if (rec->range->hdr->SizeOfRawData < rec->length || rec->range->offset + (end - rec->range->start) > pe->length)
         {
-            uint32_t offset = sct_hdr->PointerToRawData + (address - (sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase));
+            fprintf(STDERR, "Error: patch #%"PRIu32" at %08"PRIX32" (%"PRIu32" bytes) doesn't fit section '%.8s', maybe expand the image a bit more?\n",
+                    rec->index, rec->address, rec->length, rec->range->hdr->Name);
+            errors++;
+            continue;
+        }
 
-            if (sct_hdr->SizeOfRawData < length)
-            {
-                fprintf(stderr, "Error: section length (%"PRIu32") is less than patch length (%"PRId32"), maybe expand the image a bit more?\n", sct_hdr->SizeOfRawData, length);
-                return EXIT_FAILURE;
-            }
+        const t_secrange *next = end - 1 <= UINT32_MAX ? secindex_find(&pe->index, end - 1) : NULL;
 
-            memcpy(image + offset, patch, length);
-            printf("PATCH  %8"PRId32" bytes -> %8"PRIX32"\n", length, address);
-            return EXIT_SUCCESS;
+        if (next && next != rec->range)
+        {
+            fprintf(STDERR, "%s: patch #%"PRIu32" at %08"PRIX32" (%"PRIu32" bytes) crosses from section '%.8s' into '%.8s'\n",
+                    level, rec->index, rec->address, rec->length, rec->range->hdr->Name, next->hdr->Name);
         }
+        else
+        {
+            fprintf(STDERR, "%s: patch #%"PRIu32" at %08"PRIX32" (%"PRIu32" bytes) runs %"PRIu64" bytes past the raw data of section '%.8s', maybe expand the image a bit more?\n",
+                    level, rec->index, rec->address, rec->length, end - rec->range->end, rec->range->hdr->Name);
+        }
+
+        (*crossing)++;
     }
 
-    fprintf(stderr, "Error: memory address %08"PRIX32" not found in image\n", address);
-    return EXIT_FAILURE;
+    return errors;
 }
 
-uint32_t get_uint32(int8_t * *p)
+/*
+ * Finds records writing to the same bytes. With the records sorted by address
+ * a record overlaps something before it exactly when it starts below the
+ * furthest end seen so far, so one sweep reports every conflicting record
+ * against the earlier record reaching furthest into it.
+ */
+static uint32_t check_overlaps(const t_patch *records, const uint64_t *sorted, uint32_t nrecords, bool strict)
 {
-    uint32_t ret = *(uint32_t *)*p;
-    *p += sizeof(uint32_t);
-    return ret;
+    uint32_t overlaps = 0;
+    const t_patch *reach = NULL;
+    uint64_t reach_end = 0;
+
+    for (uint32_t i = 0; i < nrecords; i++)
+    {
+        const t_patch *rec = &records[(uint32_t)sorted[i]];
+        uint64_t end = (uint64_t)rec->address + rec->length;
+
+        if (rec->length == 0)
+            continue;
+
+        if (reach && rec->address < reach_end)
+        {
+            uint64_t overlap_end = end < reach_end ? end : reach_end;
+
+            fprintf(STDERR, "%s: patch #%"PRIu32" %08"PRIX32"-%08"PRIX64" overlaps patch #%"PRIu32" %08"PRIX32"-%08"PRIX64" at %08"PRIX32"-%08"PRIX64"\n",
+                    strict ? "Error" : "Warning", rec->index, rec->address, end - 1,
+                    reach->index, reach->address, reach_end - 1,
+                    rec->address, overlap_end - 1);
+            overlaps++;
+        }
+
+        if (end > reach_end)
+        {
+            reach = rec;
+            reach_end = end;
+        }
+    }
+
+    return overlaps;
 }
 
-int patch(int argc, char **argv)
+// Orders keys by the record index in the low half, which is section order
+static int compare_index(const void *a, const void *b)
 {
-    // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_FAILURE;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
+    uint32_t x = (uint32_t)*(const uint64_t *)a;
+    uint32_t y = (uint32_t)*(const uint64_t *)b;
 
-    FAIL_IF(argc < 2, "usage: petool patch <image> [section]\n");
+    return x < y ? -1 : x > y;
+}
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "r+b"));
+/*
+ * Sorts the records into the ones left alone, with the journal entry of the
+ * previous run marked kept, and the pending ones to write. Returns how many
+ * bytes the pending ones cover.
+ */
+static uint64_t select_pending(t_pe_image *pe, const t_journal *journal, const t_patch *records, const uint64_t *sorted, uint32_t nrecords,
+                               bool incremental, bool *kept, t_journal_entry *entries, uint64_t *pending, uint32_t *npending, t_patch_stats *stats)
+{
+    uint64_t size = 0;
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+    memset(kept, 0, (journal->nentries + 1) * sizeof *kept);
+    stats->unchanged = 0;
+    *npending = 0;
 
-    char *section = argc > 2 ? (char *)argv[2] : ".patch";
-    int8_t *patch = NULL;
-    int32_t patch_len = 0;
+    for (uint32_t i = 0; i < nrecords; i++)
+    {
+        const t_patch *rec = &records[(uint32_t)sorted[i]];
+        const t_journal_entry *old = journal_find(journal, rec->address, rec->length);
 
-    for (int32_t i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+        entries[i].address  = rec->address;
+        entries[i].length   = rec->length;
+        entries[i].hash     = hash64(rec->data, rec->length, 0);
+        entries[i].original = NULL;
+
+        if (incremental && old && old->hash == entries[i].hash && memcmp(patch_target(&pe->map, rec->range, rec->address), rec->data, rec->length) == 0)
+        {
+            entries[i].original = old->original;
+            kept[old - journal->entries] = true;
+            stats->unchanged++;
+            continue;
+        }
+
+        pending[(*npending)++] = sorted[i];
+        size += rec->length;
+    }
+
+    return size;
+}
+
+/*
+ * Whether restoring the journal entries that aren't kept would write over a
+ * record left alone. Both are in address order, so one sweep over them in
+ * step finds any entry starting within the reach of the other kind.
+ */
+static bool restore_hits_kept(const t_journal *journal, const bool *kept, const t_journal_entry *entries, uint32_t nrecords)
+{
+    uint64_t restored_end = 0, kept_end = 0;
+
+    for (uint32_t i = 0, j = 0; i < journal->nentries || j < nrecords;)
     {
-        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        // records not left alone have no original yet
+        if (j < nrecords && entries[j].original == NULL)
+        {
+            j++;
+            continue;
+        }
 
-        if (strcmp(section, (char *)sct_hdr->Name) == 0)
+        if (i < journal->nentries && kept[i])
         {
-            patch = image + sct_hdr->PointerToRawData;
-            patch_len = sct_hdr->Misc.VirtualSize;
-            break;
+            i++;
+            continue;
         }
 
-        sct_hdr++;
+        if (j == nrecords || (i < journal->nentries && journal->entries[i].address <= entries[j].address))
+        {
+            const t_journal_entry *old = &journal->entries[i++];
+
+            if (old->length && old->address < kept_end)
+                return true;
+
+            if ((uint64_t)old->address + old->length > restored_end)
+                restored_end = (uint64_t)old->address + old->length;
+        }
+        else
+        {
+            const t_journal_entry *rec = &entries[j++];
+
+            if (rec->length && rec->address < restored_end)
+                return true;
+
+            if ((uint64_t)rec->address + rec->length > kept_end)
+                kept_end = (uint64_t)rec->address + rec->length;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Compares the patch set with the journal of the previous run. Records that
+ * are journaled with the same content and still present in the image are
+ * left alone, everything else the previous run wrote is restored first so the
+ * changed and new records capture the true original bytes. Fills entries with
+ * the journal of this run and pending with the records that need writing.
+ * Without incremental every record is rewritten, overlapping records can't be
+ * left alone as a rewritten earlier one would cover the later one. Neither
+ * can any when restoring what the previous run wrote would cover one of them.
+ */
+static int replay_journal(t_pe_image *pe, t_checksum *ck, const t_journal *journal, const t_patch *records, const uint64_t *sorted, uint32_t nrecords,
+                          bool incremental, t_journal_entry *entries, uint64_t *pending, uint32_t *npending, int8_t **arena, t_patch_stats *stats)
+{
+    int       ret  = EXIT_SUCCESS;
+    bool     *kept = calloc(journal->nentries + 1, sizeof *kept);
+    uint64_t  size = 0;
+
+    FAIL_IF(!kept, "Failed to allocate memory for journal\n");
+
+    size = select_pending(pe, journal, records, sorted, nrecords, incremental, kept, entries, pending, npending, stats);
+
+    if (incremental && restore_hits_kept(journal, kept, entries, nrecords))
+        size = select_pending(pe, journal, records, sorted, nrecords, false, kept, entries, pending, npending, stats);
+
+    for (uint32_t i = 0; i < journal->nentries; i++)
+    {
+        if (kept[i])
+            continue;
+
+        FAIL_IF_SILENT(!restore_entry(pe, ck, &journal->entries[i]));
+        stats->reverted++;
     }
 
+    *arena = malloc(size + 1);
+    FAIL_IF(!*arena, "Failed to allocate memory for journal\n");
+    STATS_ALLOC(size + 1);
+
+    int8_t *p = *arena;
+
+    for (uint32_t i = 0; i < nrecords; i++)
+    {
+        if (entries[i].original)
+            continue;
+
+        const t_patch *rec = &records[(uint32_t)sorted[i]];
+
+        memcpy(p, patch_target(&pe->map, rec->range, rec->address), rec->length);
+        entries[i].original = p;
+        p += rec->length;
+    }
+
+cleanup:
+    if (kept) free(kept);
+    return ret;
+}
+
+uint32_t get_uint32(int8_t * *p)
+{
+    uint32_t ret = *(uint32_t *)*p;
+    *p += sizeof(uint32_t);
+    return ret;
+}
+
+/*
+ * Applies the patch set in section, found is cleared if there is no such
+ * section. With a journal path only what changed since the journaled run is
+ * written and the journal for this run is left for journal_commit once the
+ * image has been written. Records that overlap or
+ * run past their section are warned about and applied like they always were
+ * unless strict, which refuses the whole set instead. Every record written
+ * gets a line of its own unless summary asks for a single line for them all.
+ */
+int patch_section(t_pe_image *pe, const char *section, t_checksum *ck, const char *journal_path, bool strict, bool summary, bool *found)
+{
+    int         ret       = EXIT_FAILURE;
+    t_patch    *records   = NULL;
+    uint64_t   *sorted    = NULL;
+    uint64_t   *tmp       = NULL;
+    uint32_t   *addresses = NULL;
+    const t_secrange **ranges = NULL;
+    t_journal   journal   = { 0 };
+    t_journal_entry *entries = NULL;
+    int8_t     *arena     = NULL;
+    t_stats_phase phase   = STATS_ENTER(STATS_PATCH);
+
+    int8_t *patch = NULL;
+    int32_t patch_len = 0;
+
+    PIMAGE_SECTION_HEADER sct_hdr = pe_image_section(pe, section);
+
+    if (sct_hdr)
+    {
+        patch = pe->image + sct_hdr->PointerToRawData;
+        patch_len = sct_hdr->Misc.VirtualSize;
+
+        // anything past the raw data belongs to whatever follows in the file
+        if ((uint32_t)patch_len > sct_hdr->SizeOfRawData)
+            patch_len = sct_hdr->SizeOfRawData;
+    }
+
+    *found = patch != NULL;
+
     if (patch == NULL)
     {
-        fprintf(stderr, "Warning: No '%s' section in given PE image.\n", section);
+        fprintf(STDERR, "Warning: No '%s' section in given PE image.\n", section);
         ret = EXIT_SUCCESS;
         goto cleanup;
     }
 
-    for (int8_t *p = patch; p < patch + patch_len;)
+    // count records first so they can be collected and translated in one go
+    uint32_t nrecords = 0;
+
+    for (int8_t *p = patch; p + 2 * sizeof(uint32_t) <= patch + patch_len;)
+    {
+        uint32_t paddress = get_uint32(&p);
+        if (paddress == 0)
+            break;
+
+        p += get_uint32(&p);
+        nrecords++;
+    }
+
+    records   = calloc(nrecords + 1, sizeof *records);
+    addresses = calloc(nrecords + 1, sizeof *addresses);
+    ranges    = calloc(nrecords + 1, sizeof *ranges);
+    sorted    = calloc(nrecords + 1, sizeof *sorted);
+    tmp       = calloc(nrecords + 1, sizeof *tmp);
+    FAIL_IF(!records || !addresses || !ranges || !sorted || !tmp, "Failed to allocate memory for patch records\n");
+    STATS_ALLOC((nrecords + 1) * (sizeof *records + sizeof *addresses + sizeof *ranges + sizeof *sorted + sizeof *tmp));
+
+    nrecords = 0;
+
+    for (int8_t *p = patch; p + 2 * sizeof(uint32_t) <= patch + patch_len;)
     {
         uint32_t paddress = get_uint32(&p);
         if (paddress == 0)
         {
-            fprintf(stderr, "Warning: Trailing zero address in '%s' section.\n", section);
+            fprintf(STDERR, "Warning: Trailing zero address in '%s' section.\n", section);
             break;
         }
 
-        uint32_t plength = get_uint32(&p);
-        FAIL_IF_SILENT(patch_image(image, paddress, p, plength) == EXIT_FAILURE);
+        records[nrecords].address = addresses[nrecords] = paddress;
+        records[nrecords].length  = get_uint32(&p);
+        records[nrecords].data    = p;
+        records[nrecords].index   = nrecords;
+
+        FAIL_IF(records[nrecords].length > (uint32_t)(patch + patch_len - p),
+                "Error: patch #%"PRIu32" at %08"PRIX32" (%"PRIu32" bytes) is cut short by the end of '%s' section\n",
+                nrecords, paddress, records[nrecords].length, section);
+
+        p += records[nrecords].length;
+        nrecords++;
+    }
+
+    secindex_translate(&pe->index, addresses, ranges, nrecords);
+
+    for (uint32_t i = 0; i < nrecords; i++)
+    {
+        records[i].range = ranges[i];
+        sorted[i] = (uint64_t)records[i].address << 32 | i;
+    }
+
+    // nothing is written unless the whole set is sound
+    sort_records(sorted, tmp, nrecords);
+
+    uint32_t crossing = 0;
+    uint32_t errors   = check_bounds(pe, records, nrecords, strict, &crossing);
+    uint32_t overlaps = check_overlaps(records, sorted, nrecords, strict);
+
+    if (strict)
+        errors += crossing + overlaps;
+
+    FAIL_IF(errors > 0, "Error: %"PRIu32" conflicts in '%s' section, image left unchanged\n", errors, section);
+
+    t_patch_stats stats = { 0 };
+    uint64_t *pending = sorted;
+    uint32_t npending = nrecords;
+
+    // the CheckSum to revert to is the one from before the first journaled run
+    uint32_t checksum = pe->nt_hdr->OptionalHeader.CheckSum;
+
+    if (journal_path)
+    {
+        bool exists;
+        FAIL_IF_SILENT(journal_load(&journal, journal_path, &exists));
+
+        if (exists)
+            checksum = journal.checksum;
+
+        entries = calloc(nrecords + 1, sizeof *entries);
+        FAIL_IF(!entries, "Failed to allocate memory for journal\n");
+        STATS_ALLOC((nrecords + 1) * sizeof *entries);
+
+        // the sort is done with tmp, it holds the records left to write now
+        pending = tmp;
+        FAIL_IF_SILENT(replay_journal(pe, ck, &journal, records, sorted, nrecords, overlaps == 0, entries, pending, &npending, &arena, &stats));
+    }
+
+    // overlapping records go in section order so the later one wins like it always has
+    if (overlaps > 0)
+        qsort(pending, npending, sizeof *pending, compare_index);
+
+    // without overlaps applying them in address order gives the same image
+    for (uint32_t i = 0, count; i < npending; i += count)
+    {
+        const t_patch *rec = &records[(uint32_t)pending[i]];
+        uint32_t end = rec->address + rec->length;
+
+        for (count = 1; i + count < npending; count++)
+        {
+            const t_patch *next = &records[(uint32_t)pending[i + count]];
+
+            if (next->address != end || next->range != rec->range)
+                break;
+
+            end += next->length;
+        }
+
+        patch_run(&pe->map, ck, records, pending + i, count, &stats);
+    }
+
+    if (summary)
+    {
+        fprintf(STDOUT, "PATCH  %"PRIu32" records in %"PRIu32" runs, %"PRIu32" bytes\n", stats.records, stats.runs, stats.bytes);
+    }
+    else
+    {
+        // in section order whatever order they were written in
+        for (uint32_t i = 0; i < nrecords; i++)
+        {
+            if (records[i].written)
+                fprintf(STDOUT, "PATCH  %8"PRId32" bytes -> %8"PRIX32"\n", records[i].length, records[i].address);
+        }
+    }
+    STATS_COUNT(STATS_RECORDS, nrecords);
+
+    if (journal_path)
+    {
+        fprintf(STDOUT, "JOURNAL %"PRIu32" unchanged, %"PRIu32" reverted -> %s\n", stats.unchanged, stats.reverted, journal_path);
 
-        p += plength;
+        // an untouched patch set leaves the journal as it was
+        if (stats.unchanged != nrecords || journal.nentries != nrecords)
+            FAIL_IF_SILENT(journal_write(journal_path, checksum, entries, nrecords));
     }
 
-    /* FIXME: implement checksum calculation */
-    nt_hdr->OptionalHeader.CheckSum = 0;
+    ret = EXIT_SUCCESS;
+cleanup:
+    if (ranges)    free(ranges);
+    if (addresses) free(addresses);
+    if (records)   free(records);
+    if (sorted)    free(sorted);
+    if (tmp)       free(tmp);
+    if (entries)   free(entries);
+    if (arena)     free(arena);
+    journal_free(&journal);
+    STATS_LEAVE(phase);
+    return ret;
+}
+
+// Restores every journaled record and the CheckSum, the journal itself is left for the caller
+static int revert_journal(t_pe_image *pe, const char *journal_path)
+{
+    int       ret     = EXIT_SUCCESS;
+    t_journal journal = { 0 };
+    bool      exists;
+    uint32_t  bytes   = 0;
+
+    FAIL_IF_SILENT(journal_load(&journal, journal_path, &exists));
+    FAIL_IF(!exists, "%s: no journal to revert from\n", journal_path);
+
+    for (uint32_t i = 0; i < journal.nentries; i++)
+    {
+        FAIL_IF_SILENT(!restore_entry(pe, NULL, &journal.entries[i]));
+        bytes += journal.entries[i].length;
+    }
+
+    pe->nt_hdr->OptionalHeader.CheckSum = journal.checksum;
+    mapfile_dirty(&pe->map, &pe->nt_hdr->OptionalHeader.CheckSum, sizeof (uint32_t));
+
+    fprintf(STDOUT, "REVERT %"PRIu32" records, %"PRIu32" bytes <- %s\n", journal.nentries, bytes, journal_path);
+
+cleanup:
+    journal_free(&journal);
+    return ret;
+}
+
+int patch(int argc, char **argv)
+{
+    // decleration before more meaningful initialization for cleanup
+    int        ret = EXIT_FAILURE;
+    t_pe_image pe  = { 0 };
+    char      *journal_path = NULL;
+
+    bool update_checksum = opt_flag(&argc, argv, "--checksum");
+    bool trust_checksum  = opt_flag(&argc, argv, "--trust-checksum");
+    bool summary         = opt_flag(&argc, argv, "--summary");
+    bool strict          = opt_flag(&argc, argv, "--strict");
+    bool journal         = opt_flag(&argc, argv, "--journal");
+    bool revert          = opt_flag(&argc, argv, "--revert");
+
+    FAIL_IF(argc < 2 || (journal && revert), "usage: petool patch <image> [section] [--checksum [--trust-checksum]] [--strict] [--summary] [--journal | --revert]\n");
+
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_UPDATE, 0));
+
+    PIMAGE_NT_HEADERS nt_hdr = pe.nt_hdr;
+
+    if (journal || revert)
+    {
+        journal_path = malloc(strlen(argv[1]) + sizeof ".journal");
+        FAIL_IF(!journal_path, "Failed to allocate memory for journal path\n");
+        sprintf(journal_path, "%s.journal", argv[1]);
+    }
+
+    if (revert)
+    {
+        // the image gets back the CheckSum it had, whatever --checksum says
+        FAIL_IF_SILENT(revert_journal(&pe, journal_path));
+    }
+    else
+    {
+        t_checksum ck;
+        if (update_checksum && trust_checksum)
+            checksum_resume(&ck, pe.image, pe.length);
+        else if (update_checksum)
+            checksum_init(&ck, pe.image, pe.length);
+
+        bool found;
+        FAIL_IF_SILENT(patch_section(&pe, argc > 2 ? argv[2] : ".patch", update_checksum ? &ck : NULL, journal_path, strict, summary, &found));
+
+        if (!found)
+        {
+            ret = EXIT_SUCCESS;
+            goto cleanup;
+        }
+
+        nt_hdr->OptionalHeader.CheckSum = update_checksum ? checksum_value(&ck, pe.length) : 0;
+        mapfile_dirty(&pe.map, &nt_hdr->OptionalHeader.CheckSum, sizeof (uint32_t));
+    }
+
+    FAIL_IF_SILENT(mapfile_sync(&pe.map));
+
+    // the image is back to what the journal started from
+    if (revert)
+        FAIL_IF_PERROR(remove(journal_path) != 0, journal_path);
 
-    rewind(fh);
-    FAIL_IF_PERROR(fwrite(image, length, 1, fh) != 1, "Error writing executable");
+    // only now that the image is written does the journal describe it
+    if (journal)
+        FAIL_IF_SILENT(journal_commit(journal_path));
 
     ret = EXIT_SUCCESS;
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    if (ret != EXIT_SUCCESS && journal && journal_path) journal_discard(journal_path);
+    if (journal_path) free(journal_path);
+    pe_image_close(&pe);
     return ret;
 }
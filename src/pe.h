@@ -16,6 +16,8 @@
 
 // based on MingW headers converted to stdint
 
+#pragma once
+
 #include <stdint.h>
 
 #define IMAGE_DOS_SIGNATURE    0x5A4D     /* MZ   */
@@ -25,12 +27,15 @@
 #define IMAGE_VXD_SIGNATURE    0x454C     /* LE   */
 #define IMAGE_NT_SIGNATURE     0x00004550 /* PE00 */
 
+#define IMAGE_FILE_LOCAL_SYMS_STRIPPED      0x0008
+
 #define IMAGE_SCN_CNT_CODE                  0x00000020
 #define IMAGE_SCN_CNT_INITIALIZED_DATA      0x00000040
 #define IMAGE_SCN_CNT_UNINITIALIZED_DATA    0x00000080
 #define IMAGE_SCN_MEM_EXECUTE               0x20000000
 #define IMAGE_SCN_MEM_READ                  0x40000000
 #define IMAGE_SCN_MEM_WRITE                 0x80000000
+#define IMAGE_SCN_ALIGN_1BYTES              0x00100000
 #define IMAGE_SCN_ALIGN_MASK                0x00F00000
 
 #define IMAGE_DIRECTORY_ENTRY_EXPORT          0   // Export Directory
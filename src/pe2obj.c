@@ -27,36 +27,124 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "stats.h"
+
+/*
+ * An object of just the sections with the given name, for linking them from
+ * an object of their own instead of from the whole image.
+ */
+static int pe2obj_section(t_pe_image *pe, const char *name, FILE *fh)
+{
+    int      ret      = EXIT_SUCCESS;
+    uint16_t nsections = 0;
+
+    FAIL_IF_PERROR(fseek(pe->map.fh, 0L, SEEK_END) != 0, "Error reading executable");
+    long length = ftell(pe->map.fh);
+    FAIL_IF_PERROR(length < 0, "Error reading executable");
+
+    for (int i = 0; i < pe->nsections; i++)
+    {
+        if (strncmp((char *)pe->sections[i].Name, name, IMAGE_SIZEOF_SHORT_NAME) == 0)
+            nsections++;
+    }
+
+    IMAGE_FILE_HEADER FileHeader;
+    memset(&FileHeader, 0, sizeof FileHeader);
+    FileHeader.Machine = pe->nt_hdr->FileHeader.Machine;
+    FileHeader.NumberOfSections = nsections;
+    FileHeader.Characteristics = 0x0104;
+
+    FAIL_IF_PERROR(fwrite(&FileHeader, sizeof FileHeader, 1, fh) != 1, "Error writing output");
+
+    uint32_t offset = sizeof FileHeader + nsections * sizeof(IMAGE_SECTION_HEADER);
+
+    for (int i = 0; i < pe->nsections; i++)
+    {
+        IMAGE_SECTION_HEADER cur_sct = pe->sections[i];
+
+        if (strncmp((char *)cur_sct.Name, name, IMAGE_SIZEOF_SHORT_NAME) != 0)
+            continue;
+
+        if (cur_sct.Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(cur_sct.Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA))
+            cur_sct.SizeOfRawData = 0;
+
+        // ld takes the size of an object section from its raw data, not the file alignment padding
+        if (cur_sct.Misc.VirtualSize && cur_sct.Misc.VirtualSize < cur_sct.SizeOfRawData)
+            cur_sct.SizeOfRawData = cur_sct.Misc.VirtualSize;
+
+        cur_sct.PointerToRawData = cur_sct.SizeOfRawData ? offset : 0;
+        cur_sct.PointerToRelocations = 0;
+        cur_sct.PointerToLinenumbers = 0;
+        cur_sct.NumberOfRelocations = 0;
+        cur_sct.NumberOfLinenumbers = 0;
+        offset += cur_sct.SizeOfRawData;
+
+        FAIL_IF_PERROR(fwrite(&cur_sct, sizeof cur_sct, 1, fh) != 1, "Error writing output");
+    }
+
+    STATS_COUNT(STATS_BYTES_WRITTEN, sizeof FileHeader + nsections * sizeof(IMAGE_SECTION_HEADER));
+
+    for (int i = 0; i < pe->nsections; i++)
+    {
+        const PIMAGE_SECTION_HEADER cur_sct = &pe->sections[i];
+
+        if (strncmp((char *)cur_sct->Name, name, IMAGE_SIZEOF_SHORT_NAME) != 0)
+            continue;
+
+        if (cur_sct->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(cur_sct->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA))
+            continue;
+
+        uint32_t size = cur_sct->SizeOfRawData;
+        if (cur_sct->Misc.VirtualSize && cur_sct->Misc.VirtualSize < size)
+            size = cur_sct->Misc.VirtualSize;
+
+        FAIL_IF((uint64_t)cur_sct->PointerToRawData + size > (uint64_t)length,
+                "Section '%s' is outside the file.\n", name);
+
+        FAIL_IF_SILENT(file_send(pe->map.fh, cur_sct->PointerToRawData, size, fh));
+        STATS_COUNT(STATS_BYTES_WRITTEN, size);
+    }
+
+cleanup:
+    return ret;
+}
 
 int pe2obj(int argc, char **argv)
 {
     // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
+    int        ret = EXIT_SUCCESS;
+    FILE      *fh  = NULL;
+    t_pe_image pe  = { 0 };
 
-    FAIL_IF(argc != 3, "usage: petool pe2obj <in> <out>\n");
+    const char *section = opt_value(&argc, argv, "--section");
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "rb"));
+    FAIL_IF(argc != 3, "usage: petool pe2obj <in> <out> [--section <name>]\n");
 
+    // only the headers change, the rest goes from file to file
+    FAIL_IF_SILENT(pe_image_open_headers(&pe, argv[1], 0));
 
-    fclose(fh);
-    fh = NULL; // for cleanup
+    if (section)
+    {
+        FAIL_IF(pe_image_section(&pe, section) == NULL, "No '%s' section in given PE image.\n", section);
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+        fh = fopen(argv[2], "wb");
+        FAIL_IF_PERROR(!fh, "Error opening output file");
 
-    FAIL_IF(length < 512,                            "File too small.\n");
-    FAIL_IF(dos_hdr->e_magic != IMAGE_DOS_SIGNATURE, "File DOS signature invalid.\n");
-    FAIL_IF(nt_hdr->Signature != IMAGE_NT_SIGNATURE, "File NT signature invalid.\n");
+        ret = pe2obj_section(&pe, section, fh);
+        goto cleanup;
+    }
+
+    PIMAGE_DOS_HEADER dos_hdr = pe.dos_hdr;
+    uint32_t start   = dos_hdr->e_lfanew + 4;
+    uint32_t headers = (int8_t *)(pe.sections + pe.nsections) - pe.image;
 
-    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    for (int i = 0; i < pe.nsections; i++)
     {
-        const PIMAGE_SECTION_HEADER cur_sct = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        const PIMAGE_SECTION_HEADER cur_sct = &pe.sections[i];
         if (cur_sct->PointerToRawData)
         {
-            cur_sct->PointerToRawData -= dos_hdr->e_lfanew + 4;
+            cur_sct->PointerToRawData -= start;
         }
 
         if (cur_sct->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA && !(cur_sct->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA))
@@ -66,17 +154,23 @@ int pe2obj(int argc, char **argv)
         }
     }
 
+    FAIL_IF_PERROR(fseek(pe.map.fh, 0L, SEEK_END) != 0, "Error reading executable");
+    long length = ftell(pe.map.fh);
+    FAIL_IF_PERROR(length < 0, "Error reading executable");
+
     fh = fopen(argv[2], "wb");
     FAIL_IF_PERROR(!fh, "Error opening output file");
 
-    FAIL_IF_PERROR(fwrite((char *)image + (dos_hdr->e_lfanew + 4),
-                         length - (dos_hdr->e_lfanew + 4),
-                         1,
-                         fh) != 1,
+    FAIL_IF_PERROR(fwrite((char *)pe.image + start, headers - start, 1, fh) != 1,
                   "Failed to write object file to output file\n");
+    STATS_COUNT(STATS_BYTES_WRITTEN, headers - start);
+
+    FAIL_IF_SILENT(file_send(pe.map.fh, headers, length - headers, fh));
+    STATS_COUNT(STATS_BYTES_WRITTEN, length - headers);
 
 cleanup:
-    if (image) free(image);
+    pe_image_close(&pe);
+    STATS_OUTPUT(fh);
     if (fh)    fclose(fh);
     return ret;
 }
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pe.h"
+#include "cleanup.h"
+#include "hash.h"
+#include "pe_image.h"
+#include "stats.h"
+
+/*
+ * Validates the headers of an image once and indexes what the commands keep
+ * looking up: sections by name through a small hash table, sections by
+ * address through a secindex, and the data directories. Commands that change
+ * the section table call pe_image_parse again to bring the indexes up to date.
+ */
+
+// Hash of the at most eight significant bytes of a section name
+static uint32_t name_hash(const char *name)
+{
+    size_t length = 0;
+
+    while (length < IMAGE_SIZEOF_SHORT_NAME && name[length])
+        length++;
+
+    return (uint32_t)hash64(name, length, 0);
+}
+
+static void free_indexes(t_pe_image *pe)
+{
+    if (pe->names) free(pe->names);
+    pe->names = NULL;
+    pe->nnames = 0;
+    secindex_free(&pe->index);
+}
+
+static int index_names(t_pe_image *pe)
+{
+    int ret = EXIT_SUCCESS;
+
+    pe->nnames = 8;
+    while (pe->nnames < pe->nsections * 2U)
+        pe->nnames *= 2;
+
+    pe->names = calloc(pe->nnames, sizeof *pe->names);
+    FAIL_IF(!pe->names, "Failed to allocate memory for section names\n");
+    STATS_ALLOC(pe->nnames * sizeof *pe->names);
+
+    for (uint16_t i = 0; i < pe->nsections; i++)
+    {
+        char name[IMAGE_SIZEOF_SHORT_NAME + 1] = { 0 };
+        memcpy(name, pe->sections[i].Name, IMAGE_SIZEOF_SHORT_NAME);
+
+        // the first of duplicate names wins like a linear search would
+        if (pe_image_section(pe, name))
+            continue;
+
+        uint32_t slot = name_hash(name) & (pe->nnames - 1);
+        while (pe->names[slot])
+            slot = (slot + 1) & (pe->nnames - 1);
+
+        pe->names[slot] = i + 1;
+    }
+
+cleanup:
+    return ret;
+}
+
+int pe_image_parse(t_pe_image *pe, int accept)
+{
+    int ret = EXIT_SUCCESS;
+    t_stats_phase phase = STATS_ENTER(STATS_PARSE);
+
+    free_indexes(pe);
+
+    pe->image      = pe->map.image;
+    pe->length     = pe->map.length;
+    pe->dos_hdr    = (void *)pe->image;
+    pe->nt_hdr     = NULL;
+    pe->sections   = NULL;
+    pe->nsections  = 0;
+    pe->data_dirs  = NULL;
+    pe->ndata_dirs = 0;
+
+    FAIL_IF(pe->length < sizeof (IMAGE_FILE_HEADER), "File too small.\n");
+
+    if (pe->dos_hdr->e_magic == IMAGE_DOS_SIGNATURE)
+    {
+        FAIL_IF(pe->length < sizeof (IMAGE_DOS_HEADER), "File too small.\n");
+
+        uint32_t lfanew = pe->dos_hdr->e_lfanew;
+
+        if (lfanew > 0 && lfanew <= pe->length - FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader)
+                && ((PIMAGE_NT_HEADERS)(pe->image + lfanew))->Signature == IMAGE_NT_SIGNATURE)
+        {
+            pe->type = PE_IMAGE_PE;
+            pe->nt_hdr = (void *)(pe->image + lfanew);
+        }
+        else
+        {
+            FAIL_IF(!(accept & PE_ACCEPT_DOS), "File NT signature invalid.\n");
+            pe->type = PE_IMAGE_DOS;
+            goto cleanup;
+        }
+    }
+    else
+    {
+        // nasty trick but we're careful, right?
+        pe->nt_hdr = (void *)(pe->image - 4);
+
+        FAIL_IF(!(accept & PE_ACCEPT_COFF), "File DOS signature invalid.\n");
+        FAIL_IF(pe->nt_hdr->FileHeader.Machine != 0x014C, "No valid signatures found.\n");
+        pe->type = PE_IMAGE_COFF;
+    }
+
+    PIMAGE_NT_HEADERS nt_hdr = pe->nt_hdr;
+    uint32_t optional = (int8_t *)&nt_hdr->OptionalHeader - pe->image;
+
+    if (pe->type == PE_IMAGE_PE)
+    {
+        uint32_t dirs = FIELD_OFFSET(IMAGE_OPTIONAL_HEADER, DataDirectory);
+
+        FAIL_IF(nt_hdr->FileHeader.SizeOfOptionalHeader < dirs
+                || optional + dirs > pe->length, "Optional header truncated.\n");
+
+        pe->data_dirs  = nt_hdr->OptionalHeader.DataDirectory;
+        pe->ndata_dirs = nt_hdr->OptionalHeader.NumberOfRvaAndSizes;
+
+        if (pe->ndata_dirs > (nt_hdr->FileHeader.SizeOfOptionalHeader - dirs) / sizeof (IMAGE_DATA_DIRECTORY))
+            pe->ndata_dirs = (nt_hdr->FileHeader.SizeOfOptionalHeader - dirs) / sizeof (IMAGE_DATA_DIRECTORY);
+
+        if (pe->ndata_dirs > IMAGE_NUMBEROF_DIRECTORY_ENTRIES)
+            pe->ndata_dirs = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+    }
+
+    pe->sections  = IMAGE_FIRST_SECTION(nt_hdr);
+    pe->nsections = nt_hdr->FileHeader.NumberOfSections;
+
+    FAIL_IF(optional + nt_hdr->FileHeader.SizeOfOptionalHeader
+            + (uint64_t)pe->nsections * sizeof (IMAGE_SECTION_HEADER) > pe->length, "Section table truncated.\n");
+
+    FAIL_IF_SILENT(index_names(pe));
+
+    // a COFF object has no image base to place its sections at
+    if (pe->type == PE_IMAGE_PE)
+        FAIL_IF_SILENT(secindex_init(&pe->index, nt_hdr));
+
+cleanup:
+    STATS_LEAVE(phase);
+    return ret;
+}
+
+int pe_image_open(t_pe_image *pe, const char *path, int mode, int accept)
+{
+    int ret = EXIT_SUCCESS;
+
+    memset(pe, 0, sizeof *pe);
+
+    FAIL_IF_SILENT(mapfile_open(&pe->map, path, mode));
+    FAIL_IF_SILENT(pe_image_parse(pe, accept));
+
+cleanup:
+    return ret;
+}
+
+// Bytes from the start the headers take as far as what was read tells
+static uint32_t headers_length(const t_mapfile *map)
+{
+    const IMAGE_DOS_HEADER *dos_hdr = (const void *)map->image;
+    uint64_t file_hdr = 0; // a COFF object starts with it
+
+    if (map->length < sizeof (IMAGE_DOS_HEADER))
+        return sizeof (IMAGE_DOS_HEADER);
+
+    if (dos_hdr->e_magic == IMAGE_DOS_SIGNATURE)
+        file_hdr = (uint64_t)(uint32_t)dos_hdr->e_lfanew + sizeof (uint32_t);
+
+    uint64_t end = file_hdr + sizeof (IMAGE_FILE_HEADER);
+
+    if (end <= map->length)
+    {
+        const IMAGE_FILE_HEADER *hdr = (const void *)(map->image + file_hdr);
+        end += hdr->SizeOfOptionalHeader + (uint64_t)hdr->NumberOfSections * sizeof (IMAGE_SECTION_HEADER);
+    }
+
+    return end > UINT32_MAX ? UINT32_MAX : end;
+}
+
+/*
+ * Reads the headers and the section table and nothing after them, for
+ * commands that pass the rest of the file through without looking at it. The
+ * file stays open in pe->map.fh.
+ */
+int pe_image_open_headers(t_pe_image *pe, const char *path, int accept)
+{
+    int ret = EXIT_SUCCESS;
+
+    memset(pe, 0, sizeof *pe);
+
+    FAIL_IF_SILENT(mapfile_open_head(&pe->map, path));
+
+    // a few rounds at most: DOS header, NT headers, section table
+    for (uint32_t length = 0; length < headers_length(&pe->map);)
+    {
+        length = headers_length(&pe->map);
+        FAIL_IF_SILENT(mapfile_head(&pe->map, length));
+
+        if (pe->map.length < length)
+            break;
+    }
+
+    FAIL_IF_SILENT(pe_image_parse(pe, accept));
+
+cleanup:
+    return ret;
+}
+
+void pe_image_close(t_pe_image *pe)
+{
+    free_indexes(pe);
+    mapfile_close(&pe->map);
+    memset(pe, 0, sizeof *pe);
+}
+
+// Section by name, names longer than eight characters never match
+PIMAGE_SECTION_HEADER pe_image_section(const t_pe_image *pe, const char *name)
+{
+    if (pe->nnames == 0 || strlen(name) > IMAGE_SIZEOF_SHORT_NAME)
+        return NULL;
+
+    for (uint32_t slot = name_hash(name) & (pe->nnames - 1); pe->names[slot]; slot = (slot + 1) & (pe->nnames - 1))
+    {
+        PIMAGE_SECTION_HEADER sct_hdr = &pe->sections[pe->names[slot] - 1];
+
+        if (strncmp(name, (char *)sct_hdr->Name, IMAGE_SIZEOF_SHORT_NAME) == 0)
+            return sct_hdr;
+    }
+
+    return NULL;
+}
+
+// Data directory entry, NULL if the optional header doesn't have it
+PIMAGE_DATA_DIRECTORY pe_image_directory(const t_pe_image *pe, uint32_t entry)
+{
+    return entry < pe->ndata_dirs ? &pe->data_dirs[entry] : NULL;
+}
+
+// Absolute addresses of a section name, or of a range as start-end or start+length
+int pe_image_range(const t_pe_image *pe, const char *spec, uint32_t *start, uint32_t *end)
+{
+    int ret = EXIT_SUCCESS;
+    PIMAGE_SECTION_HEADER sct_hdr = pe_image_section(pe, spec);
+
+    if (sct_hdr)
+    {
+        *start = pe->nt_hdr->OptionalHeader.ImageBase + sct_hdr->VirtualAddress;
+        *end   = *start + sct_hdr->SizeOfRawData;
+        goto cleanup;
+    }
+
+    char *p;
+    *start = strtoul(spec, &p, 0);
+
+    FAIL_IF(p == spec || (*p != '-' && *p != '+'), "No section or address range '%s'.\n", spec);
+
+    char op = *p++;
+    char *q;
+    uint32_t value = strtoul(p, &q, 0);
+
+    FAIL_IF(q == p || *q != '\0', "No section or address range '%s'.\n", spec);
+
+    *end = op == '+' ? *start + value : value;
+
+    FAIL_IF(*end < *start, "Address range '%s' ends before it starts.\n", spec);
+
+cleanup:
+    return ret;
+}
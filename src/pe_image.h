@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pe.h"
+#include "mapfile.h"
+#include "secindex.h"
+
+enum {
+    PE_IMAGE_PE,        // DOS stub followed by NT headers
+    PE_IMAGE_COFF,      // raw COFF object, nt_hdr points 4 bytes before the image
+    PE_IMAGE_DOS,       // plain DOS executable, no NT headers
+};
+
+// what pe_image_parse accepts besides a PE image
+#define PE_ACCEPT_COFF  (1 << PE_IMAGE_COFF)
+#define PE_ACCEPT_DOS   (1 << PE_IMAGE_DOS)
+
+typedef struct {
+    t_mapfile               map;
+    int8_t                 *image;
+    uint32_t                length;
+    int                     type;
+
+    PIMAGE_DOS_HEADER       dos_hdr;
+    PIMAGE_NT_HEADERS       nt_hdr;         // NULL for PE_IMAGE_DOS
+    PIMAGE_SECTION_HEADER   sections;
+    uint16_t                nsections;
+    PIMAGE_DATA_DIRECTORY   data_dirs;
+    uint32_t                ndata_dirs;     // NumberOfRvaAndSizes clamped to the header
+
+    uint16_t               *names;          // open addressed, section index + 1
+    uint32_t                nnames;         // power of two
+    t_secindex              index;          // sections by address
+} t_pe_image;
+
+int pe_image_open(t_pe_image *pe, const char *path, int mode, int accept);
+int pe_image_open_headers(t_pe_image *pe, const char *path, int accept);
+int pe_image_parse(t_pe_image *pe, int accept);
+void pe_image_close(t_pe_image *pe);
+PIMAGE_SECTION_HEADER pe_image_section(const t_pe_image *pe, const char *name);
+PIMAGE_DATA_DIRECTORY pe_image_directory(const t_pe_image *pe, uint32_t entry);
+int pe_image_range(const t_pe_image *pe, const char *spec, uint32_t *start, uint32_t *end);
@@ -20,12 +20,17 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <unistd.h>
 
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "outbuf.h"
+#include "pe_image.h"
+#include "hash.h"
+#include "stats.h"
 
 #pragma pack(push,2)
 typedef struct {
@@ -42,55 +47,530 @@ typedef struct {
     uint32_t    SymbolTableIndex;
     uint16_t    Type;
 } t_reloc;
+#pragma pack(pop)
+
+// Windows only uses three levels: type, name and language
+#define RESOURCE_MAX_DEPTH      16
+#define RESOURCE_MAX_TYPES      1024
+#define RESOURCE_KEY            33
+#define RESOURCE_SUBDIRECTORY   0x80000000
+#define RESOURCE_NAME_STRING    0x80000000
+#define RESOURCE_DATA_ALIGN     8
+
+// IMAGE_SCN_LNK_NRELOC_OVFL, the real count is in the first relocation
+#define SCN_NRELOC_OVFL         0x01000000
+
+typedef struct {
+    uint32_t    offset;
+    uint32_t    next;
+    uint32_t    count;
+} t_frame;
+
+typedef struct {
+    uint32_t    entry;      // data entry in the section
+    uint32_t    data;       // payload in the section
+    uint32_t    size;
+    uint32_t    type;       // key of the type it is under
+    uint32_t    moved;      // payload in its object after layout
+    bool        keep;       // first of its contents in its object
+} t_leaf;
+
+typedef struct {
+    uint64_t    hash;
+    uint32_t    leaf;       // index + 1, 0 is free
+} t_payload;
 
 typedef struct {
     uint32_t    base;
-    void        *root;
-    t_reloc     relocs[1024];
-    uint32_t    nrelocs;
+    const uint8_t *root;
+    uint32_t    length;
+    uint8_t    *seen;       // bit per byte of the section, directories and leaves visited
+    uint32_t    tree_end;   // end of the directories, names and data entries
+    uint32_t    first;      // start of the first payload
+    t_leaf     *leaves;
+    uint32_t    nleaves;
+    uint32_t    size;
+    char      (*keys)[RESOURCE_KEY]; // types by name, NULL if not needed
+    uint32_t    nkeys;
+    uint32_t    type;
+    t_frame     stack[RESOURCE_MAX_DEPTH];
+    int         depth;
 } re2obj_s;
-#pragma pack(pop)
 
-void traverse_directory(re2obj_s *state, PIMAGE_RESOURCE_DIRECTORY rdir, int level)
+static bool seen(re2obj_s *state, uint32_t offset)
+{
+    uint8_t bit = 1 << (offset & 7);
+    bool ret = state->seen[offset >> 3] & bit;
+
+    state->seen[offset >> 3] |= bit;
+    return ret;
+}
+
+static int add_leaf(re2obj_s *state, uint32_t entry, uint32_t data, uint32_t size)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (state->nleaves == state->size)
+    {
+        uint32_t count = state->size ? state->size * 2 : 256;
+        t_leaf *leaves = realloc(state->leaves, count * sizeof *leaves);
+
+        FAIL_IF(leaves == NULL, "Failed to allocate memory for resources\n");
+        STATS_ALLOC(count * sizeof *leaves);
+
+        state->leaves = leaves;
+        state->size = count;
+    }
+
+    t_leaf *leaf = &state->leaves[state->nleaves++];
+    leaf->entry = entry;
+    leaf->data  = data;
+    leaf->size  = size;
+    leaf->type  = state->type;
+    leaf->moved = data;
+    leaf->keep  = true;
+
+    if (data < state->first)
+        state->first = data;
+
+    STATS_COUNT(STATS_RECORDS, 1);
+
+cleanup:
+    return ret;
+}
+
+static int enter_directory(re2obj_s *state, uint32_t offset)
+{
+    int ret = EXIT_SUCCESS;
+
+    FAIL_IF(offset > state->length || state->length - offset < sizeof(IMAGE_RESOURCE_DIRECTORY),
+            "Resource directory at 0x%"PRIX32" is outside the section.\n", offset);
+
+    const IMAGE_RESOURCE_DIRECTORY *rdir = (const void *)(state->root + offset);
+    uint32_t count = (uint32_t)rdir->NumberOfNamedEntries + rdir->NumberOfIdEntries;
+
+    FAIL_IF(state->length - offset - sizeof(IMAGE_RESOURCE_DIRECTORY) < count * sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY),
+            "Resource directory at 0x%"PRIX32" has entries outside the section.\n", offset);
+
+    uint32_t end = offset + sizeof(IMAGE_RESOURCE_DIRECTORY) + count * sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY);
+    if (end > state->tree_end)
+        state->tree_end = end;
+
+    if (seen(state, offset))
+    {
+        for (int i = 0; i < state->depth; i++)
+            FAIL_IF(state->stack[i].offset == offset, "Resource directory at 0x%"PRIX32" contains itself.\n", offset);
+
+        // shared with another branch that already has its leaves
+        goto cleanup;
+    }
+
+    FAIL_IF(state->depth == RESOURCE_MAX_DEPTH, "Resource directory at 0x%"PRIX32" is nested too deep.\n", offset);
+
+    t_frame *frame = &state->stack[state->depth++];
+    frame->offset = offset;
+    frame->next = 0;
+    frame->count = count;
+
+cleanup:
+    return ret;
+}
+
+// Leaf data addresses are kept relative to the section
+static int visit_leaf(re2obj_s *state, uint32_t offset)
+{
+    int ret = EXIT_SUCCESS;
+
+    FAIL_IF(offset > state->length || state->length - offset < sizeof(IMAGE_RESOURCE_DATA_ENTRY),
+            "Resource data entry at 0x%"PRIX32" is outside the section.\n", offset);
+
+    if (offset + sizeof(IMAGE_RESOURCE_DATA_ENTRY) > state->tree_end)
+        state->tree_end = offset + sizeof(IMAGE_RESOURCE_DATA_ENTRY);
+
+    if (seen(state, offset))
+        goto cleanup;
+
+    const IMAGE_RESOURCE_DATA_ENTRY *leaf = (const void *)(state->root + offset);
+    uint32_t data = leaf->OffsetToData - state->base;
+
+    FAIL_IF(leaf->OffsetToData < state->base || data > state->length || state->length - data < leaf->Size,
+            "Resource data at 0x%"PRIX32" is outside the section.\n", leaf->OffsetToData);
+
+    FAIL_IF_SILENT(add_leaf(state, offset, data, leaf->Size));
+
+cleanup:
+    return ret;
+}
+
+// Names are only moved around by dedup which keeps the tree where it is
+static void track_name(re2obj_s *state, uint32_t offset)
+{
+    uint32_t end = state->length;
+
+    if (offset < state->length && state->length - offset >= sizeof(uint16_t))
+    {
+        uint16_t chars;
+        memcpy(&chars, state->root + offset, sizeof chars);
+
+        if ((state->length - offset - sizeof chars) / 2 >= chars)
+            end = offset + sizeof chars + chars * 2;
+    }
+
+    if (end > state->tree_end)
+        state->tree_end = end;
+}
+
+// The ID of a type or its name with anything but letters and digits as '_'
+static void type_key(const re2obj_s *state, const IMAGE_RESOURCE_DIRECTORY_ENTRY *rdir_ent, char *key)
+{
+    if (!(rdir_ent->Name & RESOURCE_NAME_STRING))
+    {
+        snprintf(key, RESOURCE_KEY, "%"PRIu32, rdir_ent->Name & 0xFFFF);
+        return;
+    }
+
+    uint32_t offset = rdir_ent->Name &~ RESOURCE_NAME_STRING;
+    uint16_t chars = 0;
+    int n = 0;
+
+    if (offset < state->length && state->length - offset >= sizeof chars)
+    {
+        memcpy(&chars, state->root + offset, sizeof chars);
+
+        if ((state->length - offset - sizeof chars) / 2 < chars)
+            chars = 0;
+    }
+
+    for (uint32_t i = 0; i < chars && n < RESOURCE_KEY - 1; i++)
+    {
+        uint16_t c;
+        memcpy(&c, state->root + offset + sizeof chars + i * 2, sizeof c);
+        key[n++] = c < 0x80 && isalnum(c) ? c : '_';
+    }
+
+    if (n == 0)
+        key[n++] = '_';
+
+    key[n] = '\0';
+}
+
+// Types that end up with the same key share an object
+static int find_type(re2obj_s *state, const IMAGE_RESOURCE_DIRECTORY_ENTRY *rdir_ent)
+{
+    int ret = EXIT_SUCCESS;
+    char key[RESOURCE_KEY];
+
+    type_key(state, rdir_ent, key);
+
+    for (state->type = 0; state->type < state->nkeys; state->type++)
+    {
+        if (strcmp(state->keys[state->type], key) == 0)
+            goto cleanup;
+    }
+
+    FAIL_IF(state->nkeys == RESOURCE_MAX_TYPES, "Too many resource types to split.\n");
+    strcpy(state->keys[state->nkeys++], key);
+
+cleanup:
+    return ret;
+}
+
+/*
+ * Walks the resource tree with an explicit stack. Every directory and leaf is
+ * visited once: a directory reached again from inside itself is a loop and an
+ * error, anything else reached twice is shared and was handled already.
+ */
+static int traverse_resources(re2obj_s *state)
 {
-    PIMAGE_RESOURCE_DIRECTORY_ENTRY rdir_ent = (void *)((uint8_t *)rdir + sizeof(IMAGE_RESOURCE_DIRECTORY));
+    int ret = EXIT_SUCCESS;
+
+    FAIL_IF_SILENT(enter_directory(state, 0));
 
-    for (int i = 0; i < (rdir->NumberOfNamedEntries + rdir->NumberOfIdEntries); i++)
+    while (state->depth > 0)
     {
-        if (level < 2)
+        t_frame *frame = &state->stack[state->depth - 1];
+
+        if (frame->next == frame->count)
         {
-            traverse_directory(state, (void *)((uint8_t *)state->root + (rdir_ent->OffsetToData &~ (1 << 31))), level + 1);
+            state->depth--;
+            continue;
+        }
+
+        const IMAGE_RESOURCE_DIRECTORY_ENTRY *rdir_ent = (const void *)(state->root + frame->offset
+            + sizeof(IMAGE_RESOURCE_DIRECTORY) + frame->next++ * sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY));
+
+        uint32_t offset = rdir_ent->OffsetToData &~ RESOURCE_SUBDIRECTORY;
+
+        if (rdir_ent->Name & RESOURCE_NAME_STRING)
+            track_name(state, rdir_ent->Name &~ RESOURCE_NAME_STRING);
+
+        if (state->keys && state->depth == 1)
+            FAIL_IF_SILENT(find_type(state, rdir_ent));
+
+        if (rdir_ent->OffsetToData & RESOURCE_SUBDIRECTORY)
+        {
+            FAIL_IF_SILENT(enter_directory(state, offset));
         }
         else
         {
-            PIMAGE_RESOURCE_DATA_ENTRY leaf = (void *)((uint8_t *)state->root + (rdir_ent->OffsetToData &~ (1 << 31)));
+            FAIL_IF_SILENT(visit_leaf(state, offset));
+        }
+    }
+
+cleanup:
+    return ret;
+}
+
+static int load_resources(re2obj_s *state, const t_pe_image *pe, bool types)
+{
+    int ret = EXIT_SUCCESS;
+    char *section = ".rsrc";
+    PIMAGE_SECTION_HEADER sct_hdr = pe_image_section(pe, section);
+
+    memset(state, 0, sizeof *state);
+
+    FAIL_IF(sct_hdr == NULL, "No '%s' section in given PE image.\n", section);
+
+    uint32_t length = sct_hdr->SizeOfRawData;
+    if (sct_hdr->Misc.VirtualSize > 0 && sct_hdr->Misc.VirtualSize < length)
+        length = sct_hdr->Misc.VirtualSize;
+
+    FAIL_IF(sct_hdr->PointerToRawData > pe->length || pe->length - sct_hdr->PointerToRawData < length,
+            "Section '%s' is outside the file.\n", section);
+
+    state->base = sct_hdr->VirtualAddress;
+    state->root = (const uint8_t *)pe->image + sct_hdr->PointerToRawData;
+    state->length = length;
+    state->first = length;
+
+    state->seen = calloc(length / 8 + 1, 1);
+    FAIL_IF(state->seen == NULL, "Failed to allocate memory for resources\n");
+    STATS_ALLOC(length / 8 + 1);
+
+    if (types)
+    {
+        state->keys = calloc(RESOURCE_MAX_TYPES, sizeof *state->keys);
+        FAIL_IF(state->keys == NULL, "Failed to allocate memory for resources\n");
+        STATS_ALLOC(RESOURCE_MAX_TYPES * sizeof *state->keys);
+    }
 
-            leaf->OffsetToData = leaf->OffsetToData - state->base;
+    FAIL_IF_SILENT(traverse_resources(state));
 
-            state->relocs[state->nrelocs].VirtualAddress = (uint8_t *)&leaf->OffsetToData - (uint8_t *)state->root;
-            state->relocs[state->nrelocs].Type = 7;
-            state->nrelocs++;
+cleanup:
+    return ret;
+}
+
+static void free_resources(re2obj_s *state)
+{
+    if (state->seen)   free(state->seen);
+    if (state->leaves) free(state->leaves);
+    if (state->keys)   free(state->keys);
+    memset(state, 0, sizeof *state);
+}
+
+static int leaf_cmp(const void *a, const void *b)
+{
+    const t_leaf *x = a, *y = b;
+
+    if (x->data != y->data)
+        return x->data < y->data ? -1 : 1;
+
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+/*
+ * Moves the payloads out of the way of the tree, which stays where it is.
+ * Without split they follow it in the same object, with split every type
+ * starts an object of its own. With dedup payloads with the same hash are
+ * compared in full and a data entry is pointed at the copy already in its
+ * object instead of adding another one.
+ */
+static int layout_payloads(re2obj_s *state, bool dedup, bool split)
+{
+    int        ret    = EXIT_SUCCESS;
+    t_payload *table  = NULL;
+    uint64_t  *ends   = NULL;
+    uint32_t   nslots = 1;
+
+    qsort(state->leaves, state->nleaves, sizeof *state->leaves, leaf_cmp);
+
+    ends = calloc(split ? state->nkeys + 1 : 1, sizeof *ends);
+    FAIL_IF(ends == NULL, "Failed to allocate memory for resources\n");
+
+    if (!split)
+        ends[0] = state->first;
+
+    while (nslots < state->nleaves * 2)
+        nslots <<= 1;
+
+    table = calloc(nslots, sizeof *table);
+    FAIL_IF(table == NULL, "Failed to allocate memory for resources\n");
+    STATS_ALLOC(nslots * sizeof *table);
+
+    for (uint32_t i = 0; i < state->nleaves; i++)
+    {
+        t_leaf *leaf = &state->leaves[i];
+        uint64_t *end = &ends[split ? leaf->type : 0];
+        const uint8_t *payload = state->root + leaf->data;
+        uint64_t hash = dedup ? hash64(payload, leaf->size, 0) : i;
+        uint32_t slot = hash & (nslots - 1);
+
+        for (; dedup && table[slot].leaf; slot = (slot + 1) & (nslots - 1))
+        {
+            const t_leaf *kept = &state->leaves[table[slot].leaf - 1];
+
+            if (table[slot].hash == hash && kept->size == leaf->size && kept->type == leaf->type
+                    && memcmp(state->root + kept->data, payload, leaf->size) == 0)
+                break;
+        }
+
+        if (dedup && table[slot].leaf)
+        {
+            leaf->moved = state->leaves[table[slot].leaf - 1].moved;
+            leaf->keep = false;
+            continue;
+        }
+
+        *end = (*end + RESOURCE_DATA_ALIGN - 1) &~ (uint64_t)(RESOURCE_DATA_ALIGN - 1);
+        FAIL_IF(*end + leaf->size > UINT32_MAX, "Resource section too large after moving data.\n");
+
+        leaf->moved = *end;
+        *end += leaf->size;
+
+        if (dedup)
+        {
+            table[slot].hash = hash;
+            table[slot].leaf = i + 1;
+        }
+    }
+
+cleanup:
+    if (table) free(table);
+    if (ends)  free(ends);
+    return ret;
+}
+
+// Kept payloads of the object in the order they were laid out
+static void put_payloads(t_outbuf *out, const re2obj_s *state, size_t start, bool split, uint32_t type)
+{
+    for (uint32_t i = 0; i < state->nleaves; i++)
+    {
+        const t_leaf *leaf = &state->leaves[i];
+
+        if (!leaf->keep || (split && leaf->type != type))
+            continue;
+
+        size_t pad = start + leaf->moved - out->length;
+        char *p = outbuf_reserve(out, pad);
+
+        if (p)
+        {
+            memset(p, 0, pad);
+            out->length += pad;
         }
 
-        rdir_ent++;
+        outbuf_write(out, state->root + leaf->data, leaf->size);
     }
 }
 
+static void put_symbol(t_outbuf *out, t_outbuf *strings, const char *name, int16_t scnum, uint8_t sclass)
+{
+    t_syment ent;
+    memset(&ent, 0, sizeof ent);
+
+    if (strlen(name) <= sizeof ent.e_name)
+    {
+        memcpy(ent.e_name, name, strlen(name));
+    }
+    else
+    {
+        uint32_t offset = strings->length;
+        memcpy(ent.e_name + 4, &offset, sizeof offset);
+        outbuf_write(strings, name, strlen(name) + 1);
+    }
+
+    ent.e_scnum = scnum;
+    ent.e_sclass = sclass;
+
+    outbuf_write(out, &ent, sizeof ent);
+}
+
+/*
+ * For genmak, writes the types given to --type separated by spaces and
+ * returns how many there were. Nothing if the resources can't be split.
+ */
+int re2obj_types(const t_pe_image *pe, FILE *ofh)
+{
+    int      ret = 0;
+    re2obj_s state;
+
+    if (load_resources(&state, pe, true) == EXIT_SUCCESS && state.tree_end <= state.first)
+    {
+        for (uint32_t i = 0; i < state.nkeys; i++)
+            fprintf(ofh, "%s%s", i ? " " : "", state.keys[i]);
+
+        ret = state.nkeys;
+    }
+
+    free_resources(&state);
+    return ret;
+}
+
+/*
+ * For hashstamp, chains onto hash what the object of type is made of, the
+ * size and contents of its payloads in the order they are laid out, so its
+ * stamp only changes with the resources of that type.
+ */
+int re2obj_hash_type(const t_pe_image *pe, const char *type, uint64_t *hash)
+{
+    int      ret    = EXIT_SUCCESS;
+    uint32_t object = 0;
+    re2obj_s state;
+
+    FAIL_IF_SILENT(load_resources(&state, pe, true));
+
+    while (object < state.nkeys && strcmp(state.keys[object], type) != 0)
+        object++;
+
+    FAIL_IF(object == state.nkeys, "No resources of type '%s' in given PE image.\n", type);
+
+    qsort(state.leaves, state.nleaves, sizeof *state.leaves, leaf_cmp);
+
+    for (uint32_t i = 0; i < state.nleaves; i++)
+    {
+        const t_leaf *leaf = &state.leaves[i];
+
+        if (leaf->type != object)
+            continue;
+
+        *hash = hash64(&leaf->size, sizeof leaf->size, *hash);
+        *hash = hash64(state.root + leaf->data, leaf->size, *hash);
+    }
+
+cleanup:
+    free_resources(&state);
+    return ret;
+}
+
 int re2obj(int argc, char **argv)
 {
     // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
-    FILE   *ofh   = stdout;
-    re2obj_s state;
+    int        ret     = EXIT_SUCCESS;
+    t_pe_image pe      = { 0 };
+    FILE      *ofh     = STDOUT;
+    t_outbuf   out     = { 0 };
+    t_outbuf   strings = { 0 };
+    re2obj_s   state;
 
     memset(&state, 0, sizeof(state));
 
-    FAIL_IF(argc < 2, "usage: petool re2obj <image> [ofile]\n");
+    bool dedup = opt_flag(&argc, argv, "--dedup");
+    bool tree = opt_flag(&argc, argv, "--tree");
+    const char *type = opt_value(&argc, argv, "--type");
+
+    FAIL_IF(argc < 2 || (tree && type), "usage: petool re2obj <image> [ofile] [--dedup] [--tree | --type <type>]\n");
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "r+b"));
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_READ, PE_ACCEPT_COFF));
 
     if (argc > 2)
     {
@@ -98,84 +578,138 @@ int re2obj(int argc, char **argv)
         FAIL_IF_PERROR(ofh == NULL, "%s");
     }
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+    bool split = tree || type;
+    FAIL_IF_SILENT(load_resources(&state, &pe, split));
 
-    // quick COFF hack
-    if (nt_hdr->Signature != IMAGE_NT_SIGNATURE)
+    bool layout = dedup || split;
+    if (layout && state.tree_end > state.first)
     {
-        // nasty trick but we're careful, right?
-        nt_hdr = (void *)(image - 4);
-        FAIL_IF(nt_hdr->FileHeader.Machine != 0x014C, "No valid signatures found.\n");
+        FAIL_IF(split, "Resource data is mixed with the directory, can't split it.\n");
+        fprintf(STDERR, "Resource data is mixed with the directory, not deduplicating.\n");
+        layout = false;
     }
 
-    char *section = ".rsrc";
-    void *data = NULL;
-    uint32_t data_len = 0;
+    if (layout)
+        FAIL_IF_SILENT(layout_payloads(&state, dedup, split));
 
-    for (int32_t i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    uint32_t object = 0;
+    if (type)
     {
-        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+        while (object < state.nkeys && strcmp(state.keys[object], type) != 0)
+            object++;
 
-        if (strcmp(section, (char *)sct_hdr->Name) == 0)
-        {
-            data = image + sct_hdr->PointerToRawData;
-            data_len = sct_hdr->SizeOfRawData;
-            if (sct_hdr ->Misc.VirtualSize > 0 && sct_hdr->Misc.VirtualSize < data_len)
-                data_len = sct_hdr->Misc.VirtualSize;
+        FAIL_IF(object == state.nkeys, "No resources of type '%s' in given PE image.\n", type);
+    }
 
-            state.base = sct_hdr->VirtualAddress;
-            state.root = data;
+    IMAGE_FILE_HEADER FileHeader;
+    IMAGE_SECTION_HEADER SectionHeader;
+    uint32_t headers = sizeof FileHeader + sizeof SectionHeader;
+
+    /*
+     * The object is put together in memory and written at once. The tree,
+     * unless this is the object of a type, goes first and its data entries
+     * are pointed at where the payloads ended up.
+     */
+    outbuf_init(&out, headers + state.length + 4096);
+    outbuf_reserve(&out, headers);
+    out.length += out.failed ? 0 : headers;
+
+    if (!type)
+    {
+        outbuf_write(&out, state.root, layout ? state.first : state.length);
+        FAIL_IF(out.failed, "Failed to allocate memory for output\n");
 
-            traverse_directory(&state, (PIMAGE_RESOURCE_DIRECTORY)data, 0);
-            break;
+        for (uint32_t i = 0; i < state.nleaves; i++)
+        {
+            PIMAGE_RESOURCE_DATA_ENTRY leaf = (void *)(out.data + headers + state.leaves[i].entry);
+            leaf->OffsetToData = state.leaves[i].moved;
         }
+    }
+
+    if (layout && !tree)
+        put_payloads(&out, &state, headers, split, object);
 
-        sct_hdr++;
+    uint32_t data_len = out.length - headers;
+
+    // relocation count doesn't fit, the extra first one carries it
+    uint32_t nrelocs = type ? 0 : state.nleaves;
+    bool overflow = nrelocs >= 0xFFFF;
+
+    if (overflow)
+    {
+        t_reloc count = { nrelocs + 1, 0, 0 };
+        outbuf_write(&out, &count, sizeof count);
     }
 
-    FAIL_IF(data == NULL, "No '%s' section in given PE image.\n", section);
+    // a tree has its data entries relative to the symbols of the types
+    for (uint32_t i = 0; i < nrelocs; i++)
+    {
+        t_reloc reloc;
+        reloc.VirtualAddress = state.leaves[i].entry + offsetof(IMAGE_RESOURCE_DATA_ENTRY, OffsetToData);
+        reloc.SymbolTableIndex = tree ? 1 + state.leaves[i].type : 0;
+        reloc.Type = 7; // IMAGE_REL_I386_DIR32NB
+        outbuf_write(&out, &reloc, sizeof reloc);
+    }
+
+    outbuf_init(&strings, 256);
+    outbuf_reserve(&strings, sizeof(uint32_t));
+    strings.length += strings.failed ? 0 : sizeof(uint32_t);
+
+    uint32_t nsyms = 1;
+    put_symbol(&out, &strings, ".rsrc", 1, 3);
+
+    for (uint32_t i = 0; i < state.nkeys; i++)
+    {
+        char name[sizeof "_rsrc_" + RESOURCE_KEY];
+
+        if (type && i != object)
+            continue;
+
+        snprintf(name, sizeof name, "_rsrc_%s", state.keys[i]);
+        put_symbol(&out, &strings, name, type ? 1 : 0, 2);
+        nsyms++;
+    }
+
+    // the string table is left out for the plain object as it always was
+    if (split && !strings.failed)
+    {
+        uint32_t size = strings.length;
+        memcpy(strings.data, &size, sizeof size);
+        outbuf_write(&out, strings.data, strings.length);
+    }
+
+    FAIL_IF(out.failed || strings.failed, "Failed to allocate memory for output\n");
 
-    IMAGE_FILE_HEADER FileHeader;
     memset(&FileHeader, 0, sizeof FileHeader);
     FileHeader.Machine = 0x014C;
     FileHeader.NumberOfSections = 1;
     FileHeader.Characteristics = 0x0104;
 
-    IMAGE_SECTION_HEADER SectionHeader;
+    // ld would try to merge every .rsrc as a tree of its own
     memset(&SectionHeader, 0, sizeof SectionHeader);
-    strcpy((char *)SectionHeader.Name, ".rsrc");
+    strcpy((char *)SectionHeader.Name, type ? ".rsrc$01" : ".rsrc");
     SectionHeader.SizeOfRawData = data_len;
-    SectionHeader.PointerToRawData = sizeof(FileHeader) + sizeof(SectionHeader);
-    SectionHeader.PointerToRelocations = data_len + SectionHeader.PointerToRawData;
-    SectionHeader.NumberOfRelocations = state.nrelocs;
-    SectionHeader.Characteristics = 0xC0300040;
+    SectionHeader.PointerToRawData = headers;
+    SectionHeader.PointerToRelocations = nrelocs ? data_len + SectionHeader.PointerToRawData : 0;
+    SectionHeader.NumberOfRelocations = overflow ? 0xFFFF : nrelocs;
+    SectionHeader.Characteristics = 0xC0300040 | (overflow ? SCN_NRELOC_OVFL : 0);
 
-    FileHeader.PointerToSymbolTable = SectionHeader.PointerToRelocations + (sizeof(t_reloc) * state.nrelocs);
-    FileHeader.NumberOfSymbols = 1;
+    FileHeader.PointerToSymbolTable = data_len + headers + (sizeof(t_reloc) * (nrelocs + overflow));
+    FileHeader.NumberOfSymbols = nsyms;
 
-    fwrite(&FileHeader, sizeof FileHeader, 1, ofh);
-    fwrite(&SectionHeader, sizeof SectionHeader, 1, ofh);
-    fwrite(data, data_len, 1, ofh);
-
-    for (uint32_t i = 0; i < state.nrelocs; i++)
-        fwrite(&state.relocs[i], sizeof(state.relocs[0]), 1, ofh);
-
-    t_syment ent;
-    strcpy(ent.e_name, ".rsrc");
-    ent.e_value = 0;
-    ent.e_scnum = 1;
-    ent.e_type = 0;
-    ent.e_sclass = 3;
-    ent.e_numaux = 0;
+    memcpy(out.data, &FileHeader, sizeof FileHeader);
+    memcpy(out.data + sizeof FileHeader, &SectionHeader, sizeof SectionHeader);
 
-    fwrite(&ent, sizeof ent, 1, ofh);
+    FAIL_IF_SILENT(outbuf_flush(&out, ofh));
 
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    pe_image_close(&pe);
+    outbuf_free(&out);
+    outbuf_free(&strings);
+    free_resources(&state);
     if (argc > 2)
     {
+        STATS_OUTPUT(ofh);
         if (ofh) fclose(ofh);
     }
     return ret;
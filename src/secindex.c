@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pe.h"
+#include "cleanup.h"
+#include "secindex.h"
+#include "stats.h"
+
+/*
+ * Translates absolute memory addresses to file offsets. Sections are kept
+ * sorted by address so a lookup is a binary search, and the last hit is
+ * remembered so runs of addresses in the same or the following section, like
+ * a patch set or an import table, resolve without searching at all.
+ */
+
+static int range_cmp(const void *a, const void *b)
+{
+    const t_secrange *ra = a, *rb = b;
+    return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+int secindex_init(t_secindex *idx, PIMAGE_NT_HEADERS nt_hdr)
+{
+    int ret = EXIT_SUCCESS;
+
+    memset(idx, 0, sizeof *idx);
+
+    idx->ranges = malloc((nt_hdr->FileHeader.NumberOfSections + 1) * sizeof *idx->ranges);
+    FAIL_IF(!idx->ranges, "Failed to allocate memory for section index\n");
+    STATS_ALLOC((nt_hdr->FileHeader.NumberOfSections + 1) * sizeof *idx->ranges);
+
+    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    {
+        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+
+        // sections without raw data can't be translated to file offsets
+        if (sct_hdr->SizeOfRawData == 0)
+            continue;
+
+        t_secrange *range = &idx->ranges[idx->nranges++];
+        range->start  = sct_hdr->VirtualAddress + nt_hdr->OptionalHeader.ImageBase;
+        range->end    = range->start + sct_hdr->SizeOfRawData;
+        range->offset = sct_hdr->PointerToRawData;
+        range->hdr    = sct_hdr;
+    }
+
+    qsort(idx->ranges, idx->nranges, sizeof *idx->ranges, range_cmp);
+
+cleanup:
+    return ret;
+}
+
+void secindex_free(t_secindex *idx)
+{
+    if (idx->ranges) free(idx->ranges);
+    memset(idx, 0, sizeof *idx);
+}
+
+static inline bool in_range(const t_secrange *range, uint32_t address)
+{
+    return range->start <= address && address < range->end;
+}
+
+const t_secrange *secindex_find(t_secindex *idx, uint32_t address)
+{
+    if (idx->nranges == 0)
+        return NULL;
+
+    if (in_range(&idx->ranges[idx->last], address))
+        return &idx->ranges[idx->last];
+
+    if (idx->last + 1 < idx->nranges && in_range(&idx->ranges[idx->last + 1], address))
+        return &idx->ranges[++idx->last];
+
+    uint32_t lo = 0, hi = idx->nranges;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (address < idx->ranges[mid].start)
+            hi = mid;
+        else if (address >= idx->ranges[mid].end)
+            lo = mid + 1;
+        else
+        {
+            idx->last = mid;
+            return &idx->ranges[mid];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns 0 when the address is not backed by file data
+uint32_t secindex_offset(t_secindex *idx, uint32_t address)
+{
+    const t_secrange *range = secindex_find(idx, address);
+    return range ? range->offset + (address - range->start) : 0;
+}
+
+// Index of the first range ending after address, nranges if there is none
+static uint32_t first_after(const t_secindex *idx, uint32_t address)
+{
+    uint32_t lo = 0, hi = idx->nranges;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (address >= idx->ranges[mid].end)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Resolves a batch of addresses at once, returns the number not found. While
+ * the addresses go up a cursor walks forward over the sorted ranges, so a
+ * sorted batch costs one pass over both, and only an address going backwards
+ * searches for its place again.
+ */
+size_t secindex_translate(t_secindex *idx, const uint32_t *addresses, const t_secrange **ranges, size_t count)
+{
+    size_t missing = 0;
+    uint32_t cur = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t address = addresses[i];
+
+        if (i > 0 && address < addresses[i - 1])
+            cur = first_after(idx, address);
+
+        while (cur < idx->nranges && address >= idx->ranges[cur].end)
+            cur++;
+
+        ranges[i] = cur < idx->nranges && idx->ranges[cur].start <= address ? &idx->ranges[cur] : NULL;
+
+        if (ranges[i] == NULL)
+            missing++;
+    }
+
+    return missing;
+}
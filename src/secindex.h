@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pe.h"
+
+typedef struct {
+    uint32_t                start;      // absolute address of section
+    uint32_t                end;        // start + SizeOfRawData
+    uint32_t                offset;     // PointerToRawData
+    PIMAGE_SECTION_HEADER   hdr;
+} t_secrange;
+
+typedef struct {
+    t_secrange *ranges;                 // sorted by start, no empty sections
+    uint32_t    nranges;
+    uint32_t    last;                   // last hit
+} t_secindex;
+
+int secindex_init(t_secindex *idx, PIMAGE_NT_HEADERS nt_hdr);
+void secindex_free(t_secindex *idx);
+const t_secrange *secindex_find(t_secindex *idx, uint32_t address);
+uint32_t secindex_offset(t_secindex *idx, uint32_t address);
+size_t secindex_translate(t_secindex *idx, const uint32_t *addresses, const t_secrange **ranges, size_t count);
@@ -26,41 +26,56 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "checksum.h"
 
 int setdd(int argc, char **argv)
 {
     // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
 
-    FAIL_IF(argc != 5, "usage: petool setdd <image> <#DataDirectory> <VirtualAddress> <Size>\n");
+    bool update_checksum = opt_flag(&argc, argv, "--checksum");
+    bool trust_checksum  = opt_flag(&argc, argv, "--trust-checksum");
+
+    FAIL_IF(argc != 5, "usage: petool setdd <image> <#DataDirectory> <VirtualAddress> <Size> [--checksum [--trust-checksum]]\n");
 
     uint32_t dd   = strtol(argv[2], NULL, 0);
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "r+b"));
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_UPDATE, 0));
+
+    int8_t  *image  = pe.image;
+    uint32_t length = pe.length;
+
+    PIMAGE_NT_HEADERS nt_hdr = pe.nt_hdr;
+    PIMAGE_DATA_DIRECTORY data_dir = pe_image_directory(&pe, dd);
+
+    FAIL_IF(data_dir == NULL, "Data directory #%"PRIu32" is missing.\n", dd);
+
+    t_checksum ck;
+    if (update_checksum)
+    {
+        if (trust_checksum)
+            checksum_resume(&ck, image, length);
+        else
+            checksum_init(&ck, image, length);
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr = (void *)(image + dos_hdr->e_lfanew);
+        checksum_remove(&ck, image, length, data_dir, sizeof (IMAGE_DATA_DIRECTORY));
+    }
 
-    FAIL_IF(length < sizeof (IMAGE_DOS_HEADER),               "File too small.\n");
-    FAIL_IF(dos_hdr->e_magic != IMAGE_DOS_SIGNATURE,          "File DOS signature invalid.\n");
-    FAIL_IF(dos_hdr->e_lfanew == 0,                           "NT header missing.\n");
-    FAIL_IF(nt_hdr->Signature != IMAGE_NT_SIGNATURE,          "File NT signature invalid.\n");
-    FAIL_IF(nt_hdr->OptionalHeader.NumberOfRvaAndSizes <= dd, "Data directory #%"PRIu32" is missing.\n", dd);
+    data_dir->VirtualAddress = strtol(argv[3], NULL, 0);
+    data_dir->Size = strtol(argv[4], NULL, 0);
+    mapfile_dirty(&pe.map, data_dir, sizeof (IMAGE_DATA_DIRECTORY));
 
-    nt_hdr->OptionalHeader.DataDirectory[dd].VirtualAddress = strtol(argv[3], NULL, 0);
-    nt_hdr->OptionalHeader.DataDirectory[dd].Size = strtol(argv[4], NULL, 0);
+    if (update_checksum)
+        checksum_add(&ck, image, length, data_dir, sizeof (IMAGE_DATA_DIRECTORY));
 
-    /* FIXME: implement checksum calculation */
-    nt_hdr->OptionalHeader.CheckSum = 0;
+    nt_hdr->OptionalHeader.CheckSum = update_checksum ? checksum_value(&ck, length) : 0;
+    mapfile_dirty(&pe.map, &nt_hdr->OptionalHeader.CheckSum, sizeof (uint32_t));
 
-    rewind(fh);
-    FAIL_IF_PERROR(fwrite(image, length, 1, fh) != 1, "Error writing executable");
+    FAIL_IF_SILENT(mapfile_sync(&pe.map));
 
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    pe_image_close(&pe);
     return ret;
 }
@@ -26,51 +26,63 @@
 #include "pe.h"
 #include "cleanup.h"
 #include "common.h"
+#include "pe_image.h"
+#include "checksum.h"
 
 int setvs(int argc, char **argv)
 {
     // decleration before more meaningful initialization for cleanup
-    int     ret   = EXIT_SUCCESS;
-    FILE   *fh    = NULL;
-    int8_t *image = NULL;
+    int        ret = EXIT_SUCCESS;
+    t_pe_image pe  = { 0 };
 
-    FAIL_IF(argc != 4, "usage: petool setvs <image> <section> <VirtualSize>\n");
+    bool update_checksum = opt_flag(&argc, argv, "--checksum");
+    bool trust_checksum  = opt_flag(&argc, argv, "--trust-checksum");
+
+    FAIL_IF(argc != 4, "usage: petool setvs <image> <section> <VirtualSize> [--checksum [--trust-checksum]]\n");
 
     uint32_t vs   = strtol(argv[3], NULL, 0);
 
-    uint32_t length;
-    FAIL_IF_SILENT(open_and_read(&fh, &image, &length, argv[1], "r+b"));
+    FAIL_IF(vs == 0,                                    "VirtualSize can't be zero.\n");
 
-    PIMAGE_DOS_HEADER dos_hdr = (void *)image;
-    PIMAGE_NT_HEADERS nt_hdr  = (void *)(image + dos_hdr->e_lfanew);
+    FAIL_IF_SILENT(pe_image_open(&pe, argv[1], MAPFILE_UPDATE, 0));
 
-    FAIL_IF(length < sizeof (IMAGE_DOS_HEADER),         "File too small.\n");
-    FAIL_IF(dos_hdr->e_magic != IMAGE_DOS_SIGNATURE,    "File DOS signature invalid.\n");
-    FAIL_IF(dos_hdr->e_lfanew == 0,                     "NT header missing.\n");
-    FAIL_IF(nt_hdr->Signature != IMAGE_NT_SIGNATURE,    "File NT signature invalid.\n");
-    FAIL_IF(vs == 0,                                    "VirtualSize can't be zero.\n");
+    int8_t  *image  = pe.image;
+    uint32_t length = pe.length;
+
+    PIMAGE_NT_HEADERS nt_hdr = pe.nt_hdr;
+    PIMAGE_SECTION_HEADER sct_hdr = pe_image_section(&pe, argv[2]);
+
+    FAIL_IF(sct_hdr == NULL,                            "No '%s' section in given PE image.\n", argv[2]);
+    FAIL_IF(vs < sct_hdr->SizeOfRawData,                "VirtualSize can't be smaller than raw size.\n");
+
+    t_checksum ck;
+    if (update_checksum)
+    {
+        if (trust_checksum)
+            checksum_resume(&ck, image, length);
+        else
+            checksum_init(&ck, image, length);
+
+        checksum_remove(&ck, image, length, sct_hdr, sizeof (IMAGE_SECTION_HEADER));
+        checksum_remove(&ck, image, length, &nt_hdr->OptionalHeader, sizeof (IMAGE_OPTIONAL_HEADER));
+    }
+
+    sct_hdr->Misc.VirtualSize = vs;      // update section size
+                                         // update total virtual size of image
+    nt_hdr->OptionalHeader.SizeOfImage += vs - sct_hdr->Misc.VirtualSize;
 
-    for (int32_t i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    if (update_checksum)
     {
-        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
-
-        if (strcmp(argv[2], (char *)sct_hdr->Name) == 0)
-        {
-            FAIL_IF(vs < sct_hdr->SizeOfRawData,"VirtualSize can't be smaller than raw size.\n");
-            sct_hdr->Misc.VirtualSize = vs;      // update section size
-                                                 // update total virtual size of image
-            nt_hdr->OptionalHeader.SizeOfImage += vs - sct_hdr->Misc.VirtualSize;
-            nt_hdr->OptionalHeader.CheckSum = 0; // FIXME: implement checksum calculation
-            rewind(fh);                          // write to file
-            FAIL_IF_PERROR(fwrite(image, length, 1, fh) != 1, "Error writing executable");
-            goto cleanup;                        // done
-        }
+        checksum_add(&ck, image, length, sct_hdr, sizeof (IMAGE_SECTION_HEADER));
+        checksum_add(&ck, image, length, &nt_hdr->OptionalHeader, sizeof (IMAGE_OPTIONAL_HEADER));
     }
 
-    fprintf(stderr, "No '%s' section in given PE image.\n", argv[2]);
+    nt_hdr->OptionalHeader.CheckSum = update_checksum ? checksum_value(&ck, length) : 0;
+    mapfile_dirty(&pe.map, sct_hdr, sizeof (IMAGE_SECTION_HEADER));
+    mapfile_dirty(&pe.map, &nt_hdr->OptionalHeader, sizeof (IMAGE_OPTIONAL_HEADER));
+    FAIL_IF_SILENT(mapfile_sync(&pe.map));  // write to file
 
 cleanup:
-    if (image) free(image);
-    if (fh)    fclose(fh);
+    pe_image_close(&pe);
     return ret;
 }
@@ -0,0 +1,163 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "stats.h"
+
+/*
+ * Time is charged to one phase at a time: entering a phase charges what was
+ * spent so far to the one being left, so nested phases never count twice and
+ * the phases add up to the whole run. The state is per thread so every batch
+ * job gets figures of its own.
+ */
+
+typedef struct {
+    double          wall[STATS_NPHASES];    // ms
+    double          cpu[STATS_NPHASES];     // ms
+    uint64_t        counters[STATS_NCOUNTERS];
+    t_stats_phase   phase;
+    double          wall_mark;
+    double          cpu_mark;
+} t_stats;
+
+static const char *phase_names[STATS_NPHASES] = { "command", "read", "parse", "scan", "patch", "write" };
+
+int stats_mode;
+static __thread t_stats stats;
+
+static double wall_ms(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#else
+    return clock() * 1e3 / CLOCKS_PER_SEC;
+#endif
+}
+
+static double cpu_ms(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#else
+    return clock() * 1e3 / CLOCKS_PER_SEC;
+#endif
+}
+
+static void charge(void)
+{
+    double wall = wall_ms(), cpu = cpu_ms();
+
+    stats.wall[stats.phase] += wall - stats.wall_mark;
+    stats.cpu[stats.phase]  += cpu - stats.cpu_mark;
+    stats.wall_mark = wall;
+    stats.cpu_mark  = cpu;
+}
+
+static long peak_rss_kb(void)
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return -1;
+}
+
+void stats_start(void)
+{
+    memset(&stats, 0, sizeof stats);
+    stats.phase     = STATS_COMMAND;
+    stats.wall_mark = wall_ms();
+    stats.cpu_mark  = cpu_ms();
+}
+
+// Returns the phase to go back to with stats_leave()
+t_stats_phase stats_enter(t_stats_phase phase)
+{
+    t_stats_phase prev = stats.phase;
+
+    charge();
+    stats.phase = phase;
+    return prev;
+}
+
+void stats_leave(t_stats_phase prev)
+{
+    charge();
+    stats.phase = prev;
+}
+
+void stats_count(int counter, uint64_t n)
+{
+    stats.counters[counter] += n;
+}
+
+void stats_alloc(uint64_t size)
+{
+    stats.counters[STATS_ALLOCS]++;
+    stats.counters[STATS_ALLOC_BYTES] += size;
+}
+
+// Counts what was written to a stream, pipes and terminals can't tell
+void stats_output(FILE *fh)
+{
+    long pos = fh ? ftell(fh) : -1;
+
+    if (pos > 0)
+        stats.counters[STATS_BYTES_WRITTEN] += pos;
+}
+
+void stats_report(FILE *fh, const char *command)
+{
+    double wall = 0, cpu = 0;
+    long rss = peak_rss_kb();
+
+    charge();
+
+    for (int i = 0; i < STATS_NPHASES; i++)
+    {
+        wall += stats.wall[i];
+        cpu  += stats.cpu[i];
+    }
+
+    if (stats_mode == STATS_JSON)
+    {
+        fprintf(fh, "{\"command\":\"%s\",\"phases\":{", command);
+
+        for (int i = 0; i < STATS_NPHASES; i++)
+            fprintf(fh, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", i ? "," : "", phase_names[i], stats.wall[i], stats.cpu[i]);
+
+        fprintf(fh, "},\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_read\":%"PRIu64",\"bytes_written\":%"PRIu64
+                ",\"records\":%"PRIu64",\"allocations\":%"PRIu64",\"allocated_bytes\":%"PRIu64",\"peak_rss_kb\":%ld}\n",
+                wall, cpu, stats.counters[STATS_BYTES_READ], stats.counters[STATS_BYTES_WRITTEN],
+                stats.counters[STATS_RECORDS], stats.counters[STATS_ALLOCS], stats.counters[STATS_ALLOC_BYTES], rss);
+        return;
+    }
+
+    fprintf(fh, "STATS  %-8s %10s %10s\n", command, "wall ms", "cpu ms");
+
+    for (int i = 0; i < STATS_NPHASES; i++)
+        fprintf(fh, "STATS  %-8s %10.3f %10.3f\n", phase_names[i], stats.wall[i], stats.cpu[i]);
+
+    fprintf(fh, "STATS  %-8s %10.3f %10.3f\n", "total", wall, cpu);
+    fprintf(fh, "STATS  %"PRIu64" bytes read, %"PRIu64" bytes written, %"PRIu64" records\n",
+            stats.counters[STATS_BYTES_READ], stats.counters[STATS_BYTES_WRITTEN], stats.counters[STATS_RECORDS]);
+    fprintf(fh, "STATS  %"PRIu64" allocations, %"PRIu64" bytes, peak RSS %ld KB\n",
+            stats.counters[STATS_ALLOCS], stats.counters[STATS_ALLOC_BYTES], rss);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    STATS_COMMAND,      // anything not in one of the phases below
+    STATS_READ,
+    STATS_PARSE,
+    STATS_SCAN,         // comparing images
+    STATS_PATCH,
+    STATS_WRITE,
+    STATS_NPHASES
+} t_stats_phase;
+
+enum {
+    STATS_BYTES_READ,
+    STATS_BYTES_WRITTEN,
+    STATS_RECORDS,
+    STATS_ALLOCS,
+    STATS_ALLOC_BYTES,
+    STATS_NCOUNTERS
+};
+
+enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+extern int stats_mode;
+
+// With stats off every hook is a single test of stats_mode
+#define STATS_ENTER(phase)      (stats_mode ? stats_enter(phase) : STATS_COMMAND)
+#define STATS_LEAVE(prev)       do { if (stats_mode) stats_leave(prev); } while (0)
+#define STATS_COUNT(counter, n) do { if (stats_mode) stats_count(counter, n); } while (0)
+#define STATS_ALLOC(size)       do { if (stats_mode) stats_alloc(size); } while (0)
+#define STATS_OUTPUT(fh)        do { if (stats_mode) stats_output(fh); } while (0)
+
+void stats_start(void);
+t_stats_phase stats_enter(t_stats_phase phase);
+void stats_leave(t_stats_phase prev);
+void stats_count(int counter, uint64_t n);
+void stats_alloc(uint64_t size);
+void stats_output(FILE *fh);
+void stats_report(FILE *fh, const char *command);
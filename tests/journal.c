@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Re-patches an image from pegen with the journal where two records overlap
+ * and only one of them changes between the runs. Restoring what the changed
+ * one wrote must not take away the bytes of the one left alone, and a revert
+ * must bring back the original .text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../src/pe.h"
+#include "../src/cleanup.h"
+
+#define TEXT_BYTES  16
+
+typedef struct {
+    uint8_t    *data;
+    long        length;
+    PIMAGE_SECTION_HEADER text;
+    PIMAGE_SECTION_HEADER patch;
+    uint32_t    base;
+} t_image;
+
+static int load(t_image *img, const char *path)
+{
+    int   ret = EXIT_SUCCESS;
+    FILE *fh  = fopen(path, "rb");
+
+    FAIL_IF_PERROR(fh == NULL, path);
+    FAIL_IF_PERROR(fseek(fh, 0L, SEEK_END) != 0 || (img->length = ftell(fh)) < 0 || fseek(fh, 0L, SEEK_SET) != 0, path);
+
+    img->data = malloc(img->length);
+    FAIL_IF(img->data == NULL, "Failed to allocate memory for %s\n", path);
+    FAIL_IF_PERROR(fread(img->data, img->length, 1, fh) != 1, path);
+
+    PIMAGE_DOS_HEADER dos_hdr = (void *)img->data;
+    PIMAGE_NT_HEADERS nt_hdr = (void *)(img->data + dos_hdr->e_lfanew);
+
+    img->base = nt_hdr->OptionalHeader.ImageBase;
+    img->text = img->patch = NULL;
+
+    for (int i = 0; i < nt_hdr->FileHeader.NumberOfSections; i++)
+    {
+        PIMAGE_SECTION_HEADER sct_hdr = IMAGE_FIRST_SECTION(nt_hdr) + i;
+
+        if (strcmp((char *)sct_hdr->Name, ".text") == 0)
+            img->text = sct_hdr;
+        else if (strcmp((char *)sct_hdr->Name, ".patch") == 0)
+            img->patch = sct_hdr;
+    }
+
+    FAIL_IF(img->text == NULL || img->patch == NULL, "%s: no .text or .patch section\n", path);
+
+cleanup:
+    if (fh) fclose(fh);
+    return ret;
+}
+
+static int save(const t_image *img, const char *path)
+{
+    int   ret = EXIT_SUCCESS;
+    FILE *fh  = fopen(path, "wb");
+
+    FAIL_IF_PERROR(fh == NULL, path);
+    FAIL_IF_PERROR(fwrite(img->data, img->length, 1, fh) != 1, path);
+
+cleanup:
+    if (fh) fclose(fh);
+    return ret;
+}
+
+static uint8_t *put_record(uint8_t *p, uint32_t address, uint32_t length, uint8_t fill)
+{
+    memcpy(p, &address, sizeof address);
+    memcpy(p + 4, &length, sizeof length);
+    memset(p + 8, fill, length);
+    return p + 8 + length;
+}
+
+// Replaces the patch set with an A record over the start of .text and B inside it
+static int set_patch(const char *path, uint32_t a_length, uint8_t a_fill)
+{
+    int     ret = EXIT_SUCCESS;
+    t_image img = { 0 };
+
+    FAIL_IF_SILENT(load(&img, path));
+
+    uint32_t start = img.base + img.text->VirtualAddress;
+    uint8_t *p = img.data + img.patch->PointerToRawData;
+
+    FAIL_IF(img.patch->SizeOfRawData < 2 * 8 + TEXT_BYTES + 4 + 8, "%s: .patch too small\n", path);
+    memset(p, 0, img.patch->SizeOfRawData);
+
+    p = put_record(p, start, a_length, a_fill);
+    p = put_record(p, start + 4, 4, 0xBB);
+    img.patch->Misc.VirtualSize = p + 8 - (img.data + img.patch->PointerToRawData);
+
+    FAIL_IF_SILENT(save(&img, path));
+
+cleanup:
+    free(img.data);
+    return ret;
+}
+
+static int read_text(const char *path, uint8_t *text)
+{
+    int     ret = EXIT_SUCCESS;
+    t_image img = { 0 };
+
+    FAIL_IF_SILENT(load(&img, path));
+    memcpy(text, img.data + img.text->PointerToRawData, TEXT_BYTES);
+
+cleanup:
+    free(img.data);
+    return ret;
+}
+
+static int run(const char *petool, const char *image, const char *flag)
+{
+    int  ret = EXIT_SUCCESS;
+    char cmd[1024];
+
+    FAIL_IF(snprintf(cmd, sizeof cmd, "%s patch %s %s > /dev/null 2>&1", petool, image, flag) >= (int)sizeof cmd, "Command too long\n");
+    FAIL_IF(system(cmd) != 0, "Failed: %s\n", cmd);
+
+cleanup:
+    return ret;
+}
+
+static void dump_text(const char *what, const uint8_t *text)
+{
+    fprintf(stderr, "%-9s", what);
+
+    for (int i = 0; i < TEXT_BYTES; i++)
+        fprintf(stderr, " %02X", text[i]);
+
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int     ret = EXIT_SUCCESS;
+    char    image[1024], journal[1024], cmd[2048];
+    uint8_t original[TEXT_BYTES], expected[TEXT_BYTES], text[TEXT_BYTES];
+
+    FAIL_IF(argc != 4, "usage: journal <petool> <pegen> <work directory>\n");
+
+    FAIL_IF(snprintf(image, sizeof image, "%s/journal.exe", argv[3]) >= (int)sizeof image
+            || snprintf(journal, sizeof journal, "%s.journal", image) >= (int)sizeof journal
+            || snprintf(cmd, sizeof cmd, "%s --size 1 --sections 4 --patches 4 --patch-size 16 %s", argv[2], image) >= (int)sizeof cmd,
+            "Work directory path too long\n");
+
+    remove(journal);
+    FAIL_IF(system(cmd) != 0, "Failed: %s\n", cmd);
+    FAIL_IF_SILENT(read_text(image, original));
+
+    // A covers B, which is written after it and wins
+    FAIL_IF_SILENT(set_patch(image, TEXT_BYTES, 0xAA));
+    FAIL_IF_SILENT(run(argv[1], image, "--journal"));
+
+    // A shrinks to miss B, B stays as it was and is left alone
+    FAIL_IF_SILENT(set_patch(image, 2, 0xCC));
+    FAIL_IF_SILENT(run(argv[1], image, "--journal"));
+
+    memcpy(expected, original, TEXT_BYTES);
+    memset(expected, 0xCC, 2);
+    memset(expected + 4, 0xBB, 4);
+
+    FAIL_IF_SILENT(read_text(image, text));
+
+    if (memcmp(text, expected, TEXT_BYTES) != 0)
+    {
+        dump_text("expected", expected);
+        dump_text("got", text);
+        FAIL_IF(true, "FAIL re-patch with an overlapping record left alone\n");
+    }
+
+    FAIL_IF_SILENT(run(argv[1], image, "--revert"));
+    FAIL_IF_SILENT(read_text(image, text));
+
+    if (memcmp(text, original, TEXT_BYTES) != 0)
+    {
+        dump_text("expected", original);
+        dump_text("got", text);
+        FAIL_IF(true, "FAIL revert after re-patch\n");
+    }
+
+    printf("PASS journal\n");
+
+cleanup:
+    return ret;
+}